@@ -0,0 +1,466 @@
+/*
+ * bench.cpp
+ * Benchmark suite for minix_xfm.
+ * For each directory size and name style it builds a synthetic
+ * directory of mixed entries (files with assorted extensions and sizes,
+ * subdirectories, symlinks), then times a bare readdir() walk against
+ * the getdents64() reader, read_dir(), sorting in every order,
+ * filtering as the query is typed, and, when an X display is
+ * available, full-window draw_list() renders. Every stage reports
+ * latency percentiles and heap allocations per round as JSON, and the
+ * directory walks their system calls too.
+ *
+ * Build: make xfm_bench
+ * Run:   ./xfm_bench [-s sizes] [-r rounds] [-o file]
+ *        sizes is a comma list, default 10,1000,100000,1000000;
+ *        rounds defaults to fewer for bigger directories.
+ *        `make bench` runs it under xvfb-run when that is installed.
+ */
+
+#define XFM_NO_MAIN
+#include "main.cpp"
+
+/* glibc's own allocator, wrapped below to count calls */
+extern "C" void *__libc_malloc(size_t n);
+extern "C" void *__libc_calloc(size_t n, size_t m);
+extern "C" void *__libc_realloc(void *p, size_t n);
+extern "C" void __libc_free(void *p);
+
+static unsigned long n_allocs = 0;  /* atomic */
+
+extern "C" void *malloc(size_t n) noexcept
+{
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(n);
+}
+
+extern "C" void *calloc(size_t n, size_t m) noexcept
+{
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, m);
+}
+
+extern "C" void *realloc(void *p, size_t n) noexcept
+{
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, n);
+}
+
+extern "C" void free(void *p) noexcept
+{
+    __libc_free(p);
+}
+
+#define MAX_SIZES 16
+#define MAX_ROUNDS 1000
+
+/* One stage's measurements */
+typedef struct Stage {
+    double ms[MAX_ROUNDS];
+    int n;
+    unsigned long allocs;
+    unsigned long calls;    /* system calls, where they are counted */
+} Stage;
+
+static FILE *out;
+static unsigned long getdents_calls = 0;    /* of the last do_getdents() */
+static int nresults = 0;
+static int have_display = 0;
+
+static const char *exts[] = {
+    ".c", ".h", ".txt", ".png", ".tar.gz", ".o", "", ".md"
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void stage_begin(Stage *s)
+{
+    s->n = 0;
+    s->allocs = 0;
+    s->calls = 0;
+}
+
+/* Time one call of fn into s */
+static void stage_time(Stage *s, void (*fn)(void *), void *arg)
+{
+    unsigned long a0;
+    double t;
+
+    if (s->n == MAX_ROUNDS) return;
+    a0 = __atomic_load_n(&n_allocs, __ATOMIC_RELAXED);
+    t = now_ms();
+    fn(arg);
+    t = now_ms() - t;
+    s->allocs += __atomic_load_n(&n_allocs, __ATOMIC_RELAXED) - a0;
+    s->ms[s->n++] = t;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of the sorted samples */
+static double pct(const Stage *s, int p)
+{
+    int i = (s->n * p + 99) / 100 - 1;
+
+    if (i < 0) i = 0;
+    return s->ms[i];
+}
+
+/* Print s as one JSON result object */
+static void stage_report(const Stage *s, int entries, const char *names,
+                         const char *stage)
+{
+    Stage t = *s;
+    double sum = 0;
+    int i;
+
+    if (t.n == 0) return;
+    qsort(t.ms, t.n, sizeof(double), cmp_double);
+    for (i = 0; i < t.n; i++) sum += t.ms[i];
+    fprintf(out, "%s\n    {\"entries\": %d, \"names\": \"%s\", "
+            "\"stage\": \"%s\", \"rounds\": %d, \"min_ms\": %.3f, "
+            "\"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+            "\"p99_ms\": %.3f, \"max_ms\": %.3f, \"allocs\": %lu",
+            nresults ? "," : "", entries, names, stage, t.n, t.ms[0],
+            sum / t.n, pct(&t, 50), pct(&t, 90), pct(&t, 99), t.ms[t.n - 1],
+            s->allocs / t.n);
+    if (s->calls > 0) fprintf(out, ", \"syscalls\": %lu", s->calls / t.n);
+    fprintf(out, "}");
+    nresults++;
+    fflush(out);
+}
+
+/*
+ * Fill dir with n entries: mostly files with assorted extensions and
+ * sparse sizes, every 50th a subdirectory and every 97th a symlink.
+ * Long names are about 80 bytes, short ones about 10.
+ */
+static void make_tree(const char *dir, int n, int long_names)
+{
+    char path[2048];
+    int i;
+    int fd;
+
+    for (i = 0; i < n; i++) {
+        if (long_names) {
+            snprintf(path, sizeof(path), "%s/quarterly_report_for_the_"
+                     "regional_office_revision_%07d_final_draft%s", dir,
+                     i, exts[i % 8]);
+        } else {
+            snprintf(path, sizeof(path), "%s/f%d%s", dir, i, exts[i % 8]);
+        }
+        if (i % 50 == 0) {
+            mkdir(path, 0755);
+        } else if (i % 97 == 0) {
+            if (symlink("..", path) != 0) perror("symlink");
+        } else {
+            fd = open(path, O_CREAT | O_WRONLY, 0644);
+            if (fd < 0) continue;
+            if (ftruncate(fd, (off_t)(i * 7919L % 1000003)) != 0) {
+                perror("ftruncate");
+            }
+            close(fd);
+        }
+    }
+}
+
+static void remove_tree(const char *dir)
+{
+    char cmd[1100];
+
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "could not remove %s\n", dir);
+    }
+}
+
+/* Walk dir with readdir(), as read_dir() used to */
+static void do_readdir(void *arg)
+{
+    DIR *d = opendir((const char*)arg);
+
+    if (d == NULL) return;
+    while (readdir(d) != NULL) ;
+    closedir(d);
+}
+
+/* The same walk with the reader read_dir() now uses */
+static void do_getdents(void *arg)
+{
+    static DirReader r = { -1 };
+    int fd = open((const char*)arg, O_RDONLY | O_DIRECTORY);
+
+    if (fd < 0 || dir_open(&r, fd) < 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    while (dir_next(&r) != NULL) ;
+    dir_close(&r);
+    getdents_calls = r.calls;
+}
+
+/*
+ * The getdents64() calls readdir() makes on dir. glibc's are not seen
+ * from here, so its walk is replayed with the buffer opendir() gives
+ * it: st_blksize, at least 32K and at most 1M.
+ */
+static unsigned long readdir_calls(const char *dir)
+{
+#ifdef HAVE_GETDENTS64
+    struct stat st;
+    size_t size = 32768;
+    unsigned long calls = 0;
+    char *buf;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_blksize > size) {
+        size = st.st_blksize < (1 << 20) ? st.st_blksize : (1 << 20);
+    }
+    buf = (char*)malloc(size);
+    while (buf != NULL) {
+        calls++;
+        if (syscall(SYS_getdents64, fd, buf, size) <= 0) break;
+    }
+    free(buf);
+    close(fd);
+    return calls;
+#else
+    (void)dir;
+    return 0;
+#endif
+}
+
+/* nav_open() and wait for the scanner to deliver everything */
+static void do_read_dir(void *arg)
+{
+    struct pollfd pfd;
+
+    nav_open((const char*)arg);
+    pfd.fd = wake_pipe[0];
+    pfd.events = POLLIN;
+    while (scanning) {
+        poll(&pfd, 1, -1);
+        scan_collect();
+    }
+}
+
+static void do_resort(void *arg)
+{
+    (void)arg;
+    view_resort();
+}
+
+/* Type a query one key at a time, as the key handler would */
+static void do_key(void *arg)
+{
+    filter[filter_len++] = FOLD(*(unsigned char*)arg);
+    filter[filter_len] = '\0';
+    filter_update(1);
+}
+
+static void filter_clear(void)
+{
+    filter_len = 0;
+    filter[0] = '\0';
+    filter_fuzzy = 0;
+    filter_update(0);
+}
+
+/* Repaint the whole window, somewhere else in the list each time */
+static void do_draw(void *arg)
+{
+    int r = *(int*)arg;
+
+    scroll_to(nview > LIST_ROWS ? (int)(r * 7919L % (nview - LIST_ROWS)) : 0);
+    damage_all();
+    draw_list();
+    XSync(dpy, False);
+}
+
+/* The X setup main() does, without the event loop */
+static int x_setup(void)
+{
+    XGCValues values;
+
+    dpy = XOpenDisplay(NULL);
+    if (!dpy) return 0;
+    screen_num = DefaultScreen(dpy);
+    black_pixel = BlackPixel(dpy, screen_num);
+    white_pixel = WhitePixel(dpy, screen_num);
+    win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen_num),
+                              0, 0, WINDOW_W, WINDOW_H, 1,
+                              black_pixel, white_pixel);
+    XMapWindow(dpy, win);
+    fontinfo = XLoadQueryFont(dpy, "fixed");
+    if (!fontinfo) {
+        fontinfo = XQueryFont(dpy, XGContextFromGC(DefaultGC(dpy,
+                                                             screen_num)));
+    }
+    values.graphics_exposures = False;
+    gc = XCreateGC(dpy, win, GCGraphicsExposures, &values);
+    if (fontinfo) XSetFont(dpy, gc, fontinfo->fid);
+    backbuf = XCreatePixmap(dpy, win, WINDOW_W, WINDOW_H,
+                            DefaultDepth(dpy, screen_num));
+    XSync(dpy, False);
+    return 1;
+}
+
+/* Every stage for one directory */
+static void bench_dir(const char *dir, int n, const char *style, int rounds)
+{
+    static const char *queries[] = { "7", "final", "f1.c" };
+    static const char *qnames[] = { "filter_digit", "filter_word",
+                                    "filter_fuzzy" };
+    char stage[64];
+    Stage s;
+    const char *q;
+    unsigned long draws;
+    int i, m, r;
+
+    /* the bare directory walks, old and new */
+    do_readdir((void*)dir);
+    stage_begin(&s);
+    for (r = 0; r < rounds; r++) stage_time(&s, do_readdir, (void*)dir);
+    s.calls = readdir_calls(dir) * s.n;
+    stage_report(&s, n, style, "readdir");
+    stage_begin(&s);
+    for (r = 0; r < rounds; r++) {
+        stage_time(&s, do_getdents, (void*)dir);
+        s.calls += getdents_calls;
+    }
+    stage_report(&s, n, style, "getdents");
+
+    /* scan, with the default sort as it arrives */
+    do_read_dir((void*)dir);
+    stage_begin(&s);
+    for (r = 0; r < rounds; r++) stage_time(&s, do_read_dir, (void*)dir);
+    stage_report(&s, n, style, "read_dir");
+
+    for (m = 0; m < SORT_MODES; m++) {
+        sort_mode = m;
+        do_resort(NULL);    /* the first size or mtime sort stats all */
+        stage_begin(&s);
+        for (r = 0; r < rounds; r++) stage_time(&s, do_resort, NULL);
+        snprintf(stage, sizeof(stage), "sort_%s", sort_names[m]);
+        stage_report(&s, n, style, stage);
+    }
+    sort_mode = SORT_NAME;
+    do_resort(NULL);
+
+    /* each keystroke of each query is a sample */
+    for (i = 0; i < 3; i++) {
+        stage_begin(&s);
+        for (r = 0; r < rounds; r++) {
+            filter_clear();
+            filter_fuzzy = i == 2;
+            for (q = queries[i]; *q; q++) stage_time(&s, do_key, (void*)q);
+        }
+        filter_clear();
+        stage_report(&s, n, style, qnames[i]);
+    }
+
+    if (have_display) {
+        reset_view();
+        draws = span_hist[SPAN_DRAW].count;
+        stage_begin(&s);
+        for (r = 0; r < rounds * 5; r++) stage_time(&s, do_draw, &r);
+        /* SPAN_DRAW is only recorded once the frame is copied to win */
+        if (span_hist[SPAN_DRAW].count - draws != (unsigned long)r) {
+            fprintf(stderr, "draw_list did not copy to the window\n");
+            exit(1);
+        }
+        stage_report(&s, n, style, "draw_list");
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s n,n,...] [-r rounds] [-o file]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    char dir[1024];
+    const char *tmp = getenv("TMPDIR");
+    int sizes[MAX_SIZES] = { 10, 1000, 100000, 1000000 };
+    int nsizes = 4;
+    int rounds = 0;
+    int i, l, rr;
+    char *p;
+    int c;
+
+    out = stdout;
+    while ((c = getopt(argc, argv, "s:r:o:")) != -1) {
+        switch (c) {
+        case 's':
+            nsizes = 0;
+            for (p = strtok(optarg, ","); p && nsizes < MAX_SIZES;
+                 p = strtok(NULL, ",")) {
+                sizes[nsizes++] = atoi(p);
+            }
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            if (rounds < 1 || rounds > MAX_ROUNDS / 5) usage(argv[0]);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (out == NULL) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /*
+     * Both regions, as main() makes them. They exist before the display
+     * because the listing stages damage rows without one.
+     */
+    damage = XCreateRegion();
+    present = XCreateRegion();
+    scan_start();
+    have_display = x_setup();
+    if (!have_display) {
+        fprintf(stderr, "no X display, skipping draw_list\n");
+    }
+
+    fprintf(out, "{\n  \"benchmark\": \"xfm_bench\",\n"
+            "  \"display\": %s,\n  \"results\": [",
+            have_display ? "true" : "false");
+    for (i = 0; i < nsizes; i++) {
+        for (l = 0; l < 2; l++) {
+            snprintf(dir, sizeof(dir), "%s/xfm_bench.XXXXXX",
+                     tmp && tmp[0] ? tmp : "/tmp");
+            if (mkdtemp(dir) == NULL) {
+                perror("mkdtemp");
+                return 1;
+            }
+            fprintf(stderr, "%d entries, %s names\n", sizes[i],
+                    l ? "long" : "short");
+            make_tree(dir, sizes[i], l);
+            rr = rounds ? rounds : sizes[i] >= 1000000 ? 3 :
+                 sizes[i] >= 100000 ? 10 : 50;
+            bench_dir(dir, sizes[i], l ? "long" : "short", rr);
+            remove_tree(dir);
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -1,400 +1,6052 @@
-/*
- * minix_xfm.c
- * Simple X11 file manager for Minix 3.4.0
- * ANSI C version compatible with old compilers
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <dirent.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <errno.h>
-#include <time.h>
-#include <signal.h>
-#include <sys/wait.h>
-
-#include <X11/Xlib.h>
-#include <X11/Xutil.h>
-#include <X11/keysym.h>
-
-#define WINDOW_W 800
-#define WINDOW_H 600
-#define MARGIN 8
-#define LINE_HEIGHT 18
-#define LIST_X (MARGIN)
-#define LIST_Y (MARGIN)
-#define LIST_W (WINDOW_W - 2*MARGIN)
-#define LIST_H (WINDOW_H - 2*MARGIN)
-
-/* Simple entry structure */
-typedef struct Entry {
-    char *name;
-    int is_dir;
-} Entry;
-
-/* Global state */
-static Display *dpy;
-static int screen_num;
-static Window win;
-static GC gc;
-static XFontStruct *fontinfo;
-static unsigned long black_pixel, white_pixel;
-
-static Entry *entries = NULL;
-static int nentries = 0;
-static int selected = -1;
-static char cwd[1024];
-
-/* Double-click detection */
-static Time last_click_time = 0;
-static int last_click_index = -1;
-
-/* External viewer command */
-#define DEFAULT_VIEWER "xterm -e vi"
-static char *viewer_argv[16];
-
-/* Forward declarations */
-static void setup_viewer(void);
-static void read_dir(const char *path);
-static void draw_list(void);
-static void open_entry(int idx);
-static int y_to_index(int y);
-static void handle_event(XEvent *ev);
-static void sigchld_handler(int sig);
-
-/* Utility: set viewer argv from env or default */
-static void setup_viewer(void)
-{
-    char *env = getenv("FILE_VIEWER");
-    char buf[512];
-    char *p;
-    int i = 0;
-
-    if (env && env[0] != '\0') {
-        strncpy(buf, env, sizeof(buf)-1);
-        buf[sizeof(buf)-1] = '\0';
-    } else {
-        strncpy(buf, DEFAULT_VIEWER, sizeof(buf)-1);
-        buf[sizeof(buf)-1] = '\0';
-    }
-
-    p = strtok(buf, " \t");
-    while (p != NULL && i < 15) {
-        viewer_argv[i] = strdup(p);
-        i++;
-        p = strtok(NULL, " \t");
-    }
-    viewer_argv[i] = NULL;
-}
-
-/* Read directory contents into entries[] */
-static void read_dir(const char *path)
-{
-    DIR *d;
-    struct dirent *de;
-    struct stat st;
-    Entry *tmp;
-    int cap = 0;
-    int i;
-    char full[1024];
-
-    /* free old entries */
-    if (entries != NULL) {
-        for (i = 0; i < nentries; i++) {
-            free(entries[i].name);
-        }
-        free(entries);
-        entries = NULL;
-        nentries = 0;
-    }
-
-    d = opendir(path);
-    if (!d) {
-        perror("opendir");
-        return;
-    }
-
-    /* include .. for going up, unless we are at root */
-    if (strcmp(path, "/") != 0) {
-        cap = 16;
-        entries = (Entry*)malloc(sizeof(Entry) * cap);
-        if (entries == NULL) return;
-        entries[0].name = strdup("..");
-        entries[0].is_dir = 1;
-        nentries = 1;
-    } else {
-        cap = 16;
-        entries = (Entry*)malloc(sizeof(Entry) * cap);
-        if (entries == NULL) {
-            closedir(d);
-            return;
-        }
-        nentries = 0;
-    }
-
-    while ((de = readdir(d)) != NULL) {
-        /* skip '.' */
-        if (strcmp(de->d_name, ".") == 0) continue;
-
-        if (nentries + 1 > cap) {
-            cap *= 2;
-            tmp = (Entry*)realloc(entries, sizeof(Entry) * cap);
-            if (!tmp) break; /* OOM */
-            entries = tmp;
-        }
-
-        entries[nentries].name = strdup(de->d_name);
-
-        /* determine if directory */
-        if (path[strlen(path)-1] == '/') {
-            sprintf(full, "%s%s", path, de->d_name);
-        } else {
-            sprintf(full, "%s/%s", path, de->d_name);
-        }
-
-        if (stat(full, &st) == 0 && S_ISDIR(st.st_mode)) {
-            entries[nentries].is_dir = 1;
-        } else {
-            entries[nentries].is_dir = 0;
-        }
-
-        nentries++;
-    }
-    closedir(d);
-}
-
-/* Draw the visible list */
-static void draw_list(void)
-{
-    int i;
-    int lines = LIST_H / LINE_HEIGHT;
-    char display[1024];
-    int y;
-
-    /* clear */
-    XSetForeground(dpy, gc, white_pixel);
-    XFillRectangle(dpy, win, gc, 0, 0, WINDOW_W, WINDOW_H);
-
-    XSetForeground(dpy, gc, black_pixel);
-    for (i = 0; i < nentries && i < lines; i++) {
-        y = LIST_Y + i * LINE_HEIGHT + fontinfo->ascent;
-        if (i == selected) {
-            /* draw selection rectangle */
-            XSetForeground(dpy, gc, 0xAAAAAA);
-            XFillRectangle(dpy, win, gc, LIST_X, LIST_Y + i * LINE_HEIGHT, 
-                          LIST_W, LINE_HEIGHT);
-            XSetForeground(dpy, gc, black_pixel);
-        }
-        if (entries[i].is_dir) {
-            sprintf(display, "%s/", entries[i].name);
-        } else {
-            sprintf(display, "%s", entries[i].name);
-        }
-        XDrawString(dpy, win, gc, LIST_X + 4, y, display, strlen(display));
-    }
-
-    /* draw cwd at bottom */
-    XDrawString(dpy, win, gc, LIST_X, WINDOW_H - MARGIN, cwd, strlen(cwd));
-}
-
-/* Open a file or change directory */
-static void open_entry(int idx)
-{
-    char newpath[1024];
-    char filepath[1024];
-    char *p;
-    int pid;
-    int i;
-    char *argv[20];
-    
-    if (idx < 0 || idx >= nentries) return;
-
-    if (entries[idx].is_dir) {
-        /* change directory */
-        if (strcmp(entries[idx].name, "..") == 0) {
-            p = strrchr(cwd, '/');
-            if (!p || p == cwd) {
-                /* go to root */
-                strcpy(cwd, "/");
-            } else {
-                *p = '\0';
-            }
-        } else {
-            if (strcmp(cwd, "/") == 0) {
-                sprintf(newpath, "/%s", entries[idx].name);
-            } else {
-                sprintf(newpath, "%s/%s", cwd, entries[idx].name);
-            }
-            strncpy(cwd, newpath, sizeof(cwd)-1);
-            cwd[sizeof(cwd)-1] = '\0';
-        }
-        read_dir(cwd);
-        selected = -1;
-        draw_list();
-    } else {
-        /* open file with configured viewer */
-        pid = fork();
-        if (pid == 0) {
-            /* child */
-            if (strcmp(cwd, "/") == 0) {
-                sprintf(filepath, "/%s", entries[idx].name);
-            } else {
-                sprintf(filepath, "%s/%s", cwd, entries[idx].name);
-            }
-
-            /* assemble argv: viewer_argv + filepath + NULL */
-            for (i = 0; viewer_argv[i] != NULL && i < 15; i++) {
-                argv[i] = viewer_argv[i];
-            }
-            argv[i] = filepath;
-            argv[i+1] = NULL;
-
-            /* detach from X, exec viewer */
-            setsid();
-            execvp(argv[0], argv);
-            /* if exec fails, try /bin/sh */
-            execlp("/bin/sh", "sh", "-c", viewer_argv[0], (char*)NULL);
-            /* failed: exit child */
-            _exit(127);
-        } else if (pid > 0) {
-            /* parent: don't wait */
-            return;
-        } else {
-            perror("fork");
-        }
-    }
-}
-
-/* Convert window Y to entry index */
-static int y_to_index(int y)
-{
-    int rel = y - LIST_Y;
-    if (rel < 0) return -1;
-    return rel / LINE_HEIGHT;
-}
-
-/* Handle X events */
-static void handle_event(XEvent *ev)
-{
-    int idx;
-    Time ct;
-    KeySym ks;
-    char buf[16];
-    int len;
-    
-    if (ev->type == Expose) {
-        draw_list();
-    } else if (ev->type == ButtonPress) {
-        idx = y_to_index(ev->xbutton.y);
-        ct = ev->xbutton.time;
-        if (idx >= 0 && idx < nentries) {
-            selected = idx;
-            draw_list();
-            /* detect double click: same index and within 400 ms */
-            if (last_click_index == idx && last_click_time != 0 && 
-                (ct - last_click_time) <= 400) {
-                open_entry(idx);
-                last_click_time = 0;
-                last_click_index = -1;
-            } else {
-                last_click_time = ct;
-                last_click_index = idx;
-            }
-        }
-    } else if (ev->type == KeyPress) {
-        len = XLookupString(&ev->xkey, buf, sizeof(buf), &ks, NULL);
-        if (len > 0) {
-            if (buf[0] == 'q' || buf[0] == 'Q') {
-                /* quit */
-                XCloseDisplay(dpy);
-                exit(0);
-            } else if (buf[0] == '\n' || buf[0] == '\r') {
-                if (selected >= 0) open_entry(selected);
-            }
-        } else {
-            /* arrow keys */
-            if (ks == XK_Up) {
-                if (selected > 0) selected--;
-                draw_list();
-            } else if (ks == XK_Down) {
-                if (selected < nentries-1) selected++;
-                draw_list();
-            }
-        }
-    }
-}
-
-static void sigchld_handler(int sig)
-{
-    /* reap children to avoid zombies */
-    while (waitpid(-1, NULL, WNOHANG) > 0) {
-        /* empty */
-    }
-}
-
-int main(int argc, char **argv)
-{
-    XEvent ev;
-    unsigned long valuemask = 0;
-    XGCValues values;
-    int i;
-
-    /* initial cwd */
-    if (getcwd(cwd, sizeof(cwd)) == NULL) {
-        strcpy(cwd, "/");
-    }
-
-    setup_viewer();
-
-    /* read initial directory */
-    read_dir(cwd);
-
-    /* X init */
-    dpy = XOpenDisplay(NULL);
-    if (!dpy) {
-        fprintf(stderr, "Unable to open X display.\n");
-        return 1;
-    }
-    screen_num = DefaultScreen(dpy);
-    black_pixel = BlackPixel(dpy, screen_num);
-    white_pixel = WhitePixel(dpy, screen_num);
-
-    win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen_num), 
-                             0, 0, WINDOW_W, WINDOW_H, 1, 
-                             black_pixel, white_pixel);
-    XSelectInput(dpy, win, ExposureMask | ButtonPressMask | KeyPressMask);
-    XStoreName(dpy, win, "minix_xfm");
-    XMapWindow(dpy, win);
-
-    fontinfo = XLoadQueryFont(dpy, "fixed");
-    if (!fontinfo) {
-        fontinfo = XLoadQueryFont(dpy, "6x13");
-    }
-    if (!fontinfo) {
-        fprintf(stderr, "Warning: couldn't load font\n");
-        /* Continue with default font */
-        fontinfo = XQueryFont(dpy, XGContextFromGC(DefaultGC(dpy, screen_num)));
-    }
-
-    gc = XCreateGC(dpy, win, valuemask, &values);
-    if (fontinfo) {
-        XSetFont(dpy, gc, fontinfo->fid);
-    }
-
-    /* signal handler for children */
-    signal(SIGCHLD, sigchld_handler);
-
-    /* main loop */
-    while (1) {
-        XNextEvent(dpy, &ev);
-        handle_event(&ev);
-    }
-
-    /* cleanup (unreachable) */
-    XFreeGC(dpy, gc);
-    XCloseDisplay(dpy);
-    return 0;
-}
+/*
+ * minix_xfm.c
+ * Simple X11 file manager for Minix 3.4.0 and Linux
+ *
+ * Needs a C++ compiler with the GCC __atomic builtins (GCC 4.7 or a
+ * Clang of the same age), Xlib, POSIX threads, posix_spawn() and the
+ * POSIX.1-2008 *at() calls. Build with -lX11 -lpthread.
+ * On Linux it also uses, when present: inotify for change
+ * notification, getdents64() for directory reads (64-bit only), and
+ * FICLONE, copy_file_range() (glibc 2.27) and sendfile() for copies.
+ * Elsewhere listings refresh on reentry, readdir() reads them and
+ * read()/write() copies. The filter uses SSE2 where the target has it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>       /* FICLONE */
+#define HAVE_INOTIFY 1
+#define HAVE_SENDFILE 1
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 27)
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+#if defined(__linux__) && defined(__LP64__)
+/* struct dirent is laid out as the kernel's getdents64 records */
+#include <sys/syscall.h>
+#define HAVE_GETDENTS64 1
+#endif
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+
+#define WINDOW_W 800
+#define WINDOW_H 600
+#define MARGIN 8
+#define LINE_HEIGHT 18
+#define LIST_X (MARGIN)
+#define LIST_Y (MARGIN)
+#define LIST_W (WINDOW_W - 2*MARGIN - (preview_on ? PREVIEW_W + MARGIN : 0))
+#define STATUS_H (LINE_HEIGHT)
+#define LIST_H (WINDOW_H - 2*MARGIN - STATUS_H)
+#define LIST_ROWS (LIST_H / LINE_HEIGHT)
+#define SCROLLBAR_W 6
+#define WHEEL_STEP 3
+/* The preview pane, right of the list when it is shown */
+#define PREVIEW_W 360
+#define PREVIEW_X (WINDOW_W - MARGIN - PREVIEW_W)
+#define PREVIEW_LINES (LIST_ROWS - 1)   /* below the file name */
+#define PREVIEW_COLS 60
+#define PREVIEW_BYTES 8192              /* of the file head read */
+#define PREVIEW_DELAY_MS 80
+#define PREVIEW_CACHE 64
+
+/* Frame budget: render at most once per FRAME_MS, once per event batch */
+#define FRAME_MS 16
+
+/* Kinds of latency span, see span_end() */
+#define SPAN_SCAN 0         /* read_dir() until the listing is complete */
+#define SPAN_META 1         /* one lazy stat */
+#define SPAN_SORT 2
+#define SPAN_FILTER 3
+#define SPAN_DRAW 4         /* one frame */
+#define SPAN_INPUT 5        /* key or button until its frame is shown */
+#define SPANS 6
+#define HIST_BUCKETS 32     /* of log2 microseconds */
+#define TRACE_MAX 65536     /* spans kept for the trace */
+#define DEFAULT_STATS "/tmp/xfm-stats.json"
+/* The performance overlay */
+#define HUD_W 330
+#define HUD_H ((SPANS + 1) * LINE_HEIGHT + 4)
+#define HUD_X (LIST_X + LIST_W - SCROLLBAR_W - HUD_W - 4)
+#define HUD_Y (LIST_Y + 4)
+/* Dirty entry ranges remembered per frame before giving up and redrawing */
+#define DIRTY_MAX 32
+
+/* Directory reads: getdents64() into a buffer this big, kept for reuse */
+#define DIRBUF_BYTES (1 << 20)
+
+/* Entries handed from the scanner thread to the UI per wake-up */
+#define SCAN_BATCH 256
+/* Name bytes per batch; always room for at least one NAME_MAX name */
+#define SCAN_BATCH_NAMES (SCAN_BATCH * 32)
+
+/* Entry flags */
+#define E_DIR 0x01          /* directory, or a symlink to one */
+#define E_GONE 0x02         /* deleted, leaves the view at the end of the burst */
+#define E_DEAD 0x04         /* deleted and out of the view; a tombstone */
+#define E_STALE 0x08        /* changed; its row is redrawn or re-sorted */
+#define E_NEW 0x10          /* (re)created; joins the view after the burst */
+#define E_WALKED 0x20       /* directory the subtree index descended into */
+
+/* Most subtree indexer threads, whatever the CPU count */
+#define INDEX_THREADS 8
+/* How often growing directory totals are redrawn */
+#define SIZE_TICK_MS 250
+/* Prefetch once the selection rests this long on a directory */
+#define PREFETCH_DELAY_MS 150
+/* ... and also this many directories on either side of it */
+#define PREFETCH_SIBLINGS 1
+#define PREFETCH_TARGETS (1 + 2 * PREFETCH_SIBLINGS)
+/* Unvisited prefetched listings use at most this part of the cache */
+#define PREFETCH_SHARE 4
+
+/* Copy, move and delete jobs */
+#define FILEOP_THREADS 2
+#define FILEOP_CHUNK (8 << 20)      /* per copy call, between updates */
+#define FILEOP_BUF (1 << 20)        /* for read() and write() */
+#define JOB_COPY 0
+#define JOB_MOVE 1
+#define JOB_DELETE 2
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_LINGER_MS 3000          /* a finished job stays on show */
+/* The job overlay, along the bottom of the list */
+#define JOBS_SHOWN 4
+#define JOBS_H (JOBS_SHOWN * LINE_HEIGHT + 4)
+#define JOBS_X (LIST_X + 4)
+#define JOBS_Y (LIST_Y + LIST_H - JOBS_H - 4)
+#define JOBS_W (LIST_W - SCROLLBAR_W - 8)
+
+/* File types found by sniffing, in Meta.ftype */
+#define FT_UNKNOWN 0        /* not looked at yet */
+#define FT_QUEUED 1         /* waiting to be sniffed */
+#define FT_EMPTY 2
+#define FT_TEXT 3
+#define FT_SCRIPT 4
+#define FT_ELF 5
+#define FT_EXE 6            /* other executables and bytecode */
+#define FT_IMAGE 7
+#define FT_AUDIO 8
+#define FT_VIDEO 9
+#define FT_ARCHIVE 10
+#define FT_COMPRESSED 11
+#define FT_DOCUMENT 12
+#define FT_DATABASE 13
+#define FT_DATA 14          /* binary, nothing matched */
+#define FT_UNREADABLE 15
+/* Head read for sniffing; holds the tar magic at 257 */
+#define SNIFF_BYTES 512
+#define SNIFF_BATCH 64
+/* Types kept by (dev, ino, mtime), direct-mapped */
+#define TYPE_CACHE 4096
+
+/* How long directory change events are gathered before being applied */
+#define WATCH_COALESCE_MS 100
+
+/* Sort orders; directories always come first and ".." before them */
+#define SORT_NAME 0         /* case-insensitive name */
+#define SORT_NATURAL 1      /* name with digit runs compared as numbers */
+#define SORT_SIZE 2
+#define SORT_MTIME 3
+#define SORT_TYPE 4         /* extension, then name */
+#define SORT_MODES 5
+/* Below this many keys a comparison sort beats the radix passes */
+#define SORT_RADIX_MIN 4096
+/* While scanning, merge new entries once they are 1/SORT_MERGE_DIV of the list */
+#define SORT_MERGE_DIV 4
+/* Key bits below the directories-first bit */
+#define SORT_KEY_MASK 0x7fffffffffffffffULL
+#define FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+/* Longest filter query, and the slack after the folded name arena */
+#define FILTER_MAX 255
+#define FOLD_PAD 16
+
+/*
+ * Entry record. Names are kept NUL-terminated in the names[] arena and
+ * addressed by offset, so a listing is a few flat arrays that are
+ * reset, not freed, when the directory changes. is_dir (E_DIR) is
+ * settled at scan time from d_type; the rest of the metadata is
+ * fetched lazily by entry_meta() into metas[] for rows that are shown.
+ */
+typedef struct Entry {
+    unsigned int name_off;  /* offset of the name in names[] */
+    unsigned short name_len;
+    unsigned short flags;   /* E_* */
+    int meta;               /* index into metas[], -1 until fetched */
+} Entry;
+
+/*
+ * One row of the view: an entry and its precomputed sort key. The key
+ * is an order-preserving prefix of the full ordering, so most
+ * comparisons never leave this array; equal keys fall back to
+ * sort_cmp_entries() on the names.
+ */
+typedef struct SortKey {
+    unsigned long long key;
+    int idx;                /* into entries[] */
+} SortKey;
+
+typedef struct Meta {
+    mode_t mode;            /* 0 if the entry could not be stat'ed */
+    off_t size;
+    time_t mtime;
+    dev_t dev;              /* keys directory totals */
+    ino_t ino;
+    int ftype;              /* FT_*, sniffed on demand */
+} Meta;
+
+/* A magic number: len bytes at off in the file */
+typedef struct SniffSig {
+    unsigned short off;
+    unsigned char len;
+    unsigned char type;
+    const char *magic;
+} SniffSig;
+
+/* Type of a file as of its mtime */
+typedef struct TypeRec {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    int type;               /* FT_UNKNOWN for a free slot */
+} TypeRec;
+
+/*
+ * Files of the listing for one pool task to sniff, by name under the
+ * directory, and what it found. The stat results let the UI check the
+ * entry is still the one that was asked about.
+ */
+typedef struct SniffBatch {
+    struct SniffBatch *next;
+    unsigned long gen;      /* sniff_gen it was made under */
+    int n;
+    int meta[SNIFF_BATCH];  /* into metas[], which compaction leaves be */
+    size_t name_off[SNIFF_BATCH];
+    unsigned char type[SNIFF_BATCH];
+    dev_t dev[SNIFF_BATCH];
+    ino_t ino[SNIFF_BATCH];
+    time_t mtime[SNIFF_BATCH];
+    char *names;
+    size_t names_len, names_cap;
+} SniffBatch;
+
+/*
+ * A batch of scanned entries on its way to the UI. It carries its own
+ * little name arena; name_off is relative to names[] here until
+ * scan_collect() appends it to the listing. Batches are recycled.
+ */
+typedef struct ScanBatch {
+    struct ScanBatch *next;
+    unsigned long gen;      /* scan generation it belongs to */
+    int n;
+    int done;               /* last batch of its scan */
+    size_t names_len;
+    Entry ents[SCAN_BATCH];
+    char names[SCAN_BATCH_NAMES];
+} ScanBatch;
+
+/*
+ * A directory being read, see dir_next(). The buffer outlives the
+ * directory so each thread that reads listings allocates it once.
+ */
+typedef struct DirReader {
+    int fd;                 /* -1 when closed */
+#ifdef HAVE_GETDENTS64
+    char *buf;              /* DIRBUF_BYTES of getdents64() records */
+    long len, pos;
+#else
+    DIR *dir;
+#endif
+    unsigned long calls;    /* for this directory, for the benchmark */
+} DirReader;
+
+/* A closed reader */
+#ifdef HAVE_GETDENTS64
+#define DIR_READER_INIT { -1, NULL, 0, 0, 0 }
+#else
+#define DIR_READER_INIT { -1, NULL, 0 }
+#endif
+
+typedef struct InodeKey {
+    dev_t dev;
+    ino_t ino;              /* 0 marks a free slot */
+} InodeKey;
+
+/*
+ * A running directory total: its tasks add file sizes into total, and
+ * the hard-linked inodes already counted are remembered in seen[].
+ */
+typedef struct SizeJob {
+    unsigned long gen;      /* size_gen it was started under */
+    dev_t dev;              /* of the root; the walk stays on it */
+    long long total;        /* atomic: bytes so far */
+    int left;               /* atomic: directories not yet listed */
+    int refs;               /* atomic: the UI's plus one per task */
+    int done;               /* atomic */
+    pthread_mutex_t lock;   /* guards seen[] */
+    InodeKey *seen;
+    int nseen, seen_cap;
+} SizeJob;
+
+/* Total of a directory inode, kept across visits */
+typedef struct SizeRec {
+    struct SizeRec *next;   /* hash chain */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;           /* of the directory when it was counted */
+    unsigned long visit;    /* size_visit it was counted in */
+    long long total;        /* -1 if it could not be read */
+    SizeJob *job;           /* while counting */
+} SizeRec;
+
+/*
+ * A directory for the indexer pool: a task until it is listed, then
+ * kept alive by its children, which open themselves relative to fd.
+ * For the subtree index path is relative to the root of the walk and
+ * ends in the name; for a size job (job set) it is just the name.
+ */
+typedef struct IndexDir {
+    struct IndexDir *parent;
+    struct SizeJob *job;    /* NULL for the subtree index */
+    struct SniffBatch *sniff;   /* not a directory but files to sniff */
+    struct Job *del;        /* a delete job, which empties and removes it */
+    int fd;
+    int refs;               /* atomic: itself until listed, plus children */
+    unsigned long gen;      /* walk it belongs to */
+    char *path;
+    size_t path_len;
+    size_t name_off;        /* of the last component in path */
+} IndexDir;
+
+/* Latency histogram of one kind of span */
+typedef struct Hist {
+    unsigned long b[HIST_BUCKETS];  /* b[i]: under 2^(i+1) microseconds */
+    unsigned long count;
+    long long sum_us, max_us;
+} Hist;
+
+/* A finished span, for the trace */
+typedef struct TraceEv {
+    int span;
+    long long start_us, dur_us;
+} TraceEv;
+
+/* A worker's tasks: it pushes and pops at tail, thieves take at head */
+typedef struct IndexDeque {
+    pthread_mutex_t lock;
+    IndexDir **items;
+    int head, tail, cap;
+} IndexDeque;
+
+/*
+ * A parsed listing kept after we leave its directory. Keyed by the
+ * directory's (dev, ino) and trusted only while its mtime and ctime are
+ * unchanged and were already in the past when the scan started.
+ */
+typedef struct Listing {
+    struct Listing *prev, *next;    /* LRU list, most recent first */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime, ctime;            /* of the directory itself */
+    time_t stamp;                   /* when its scan started */
+    Entry *entries;
+    int nentries, entries_cap;
+    char *names;
+    size_t names_len, names_cap;
+    Meta *metas;
+    int nmetas, metas_cap;
+    int spec;                       /* prefetched, not visited yet */
+} Listing;
+
+/* The head of one version of a file, laid out for the preview pane */
+typedef struct Preview {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    unsigned long used;     /* LRU clock; 0 for a free slot */
+    int hex;                /* a hex dump rather than text */
+    int nlines;
+    char lines[PREVIEW_LINES][PREVIEW_COLS + 16];
+} Preview;
+
+/* The file the preview thread should read, by name under fd */
+typedef struct PreviewReq {
+    int fd;                 /* -1 if there is nothing to do */
+    unsigned long gen;      /* preview_gen it was made under */
+    char *name;
+} PreviewReq;
+
+/* A copy, move or delete, run by the file operation threads */
+typedef struct Job {
+    struct Job *next;       /* under fileop_lock */
+    int op;                 /* JOB_COPY, JOB_MOVE or JOB_DELETE */
+    int state;              /* atomic; JOB_QUEUED, _RUNNING or _DONE */
+    int cancel;             /* atomic */
+    int err;                /* once done: 0, ECANCELED or why it failed */
+    int told;               /* UI side: a failure was reported */
+    int fail;               /* atomic; first error of a parallel delete */
+    int walked;             /* its pool tasks are all done, fileop_lock */
+    char *src;              /* path of what is copied or deleted */
+    char *dst;              /* directory it goes into; NULL to delete */
+    const char *name;       /* last part of src */
+    long long total;        /* atomic; bytes to copy, -1 until counted */
+    long long done;         /* atomic; bytes copied, or entries deleted */
+    long long start_us, end_us;
+} Job;
+
+/* Directories for the prefetcher to read, by name under fd */
+typedef struct PrefetchReq {
+    int fd;                 /* -1 if there is nothing to do */
+    unsigned long gen;      /* prefetch_gen it was made under */
+    int n;
+    char names[PREFETCH_TARGETS][NAME_MAX + 1];
+} PrefetchReq;
+
+/* Global state */
+static Display *dpy;
+static int screen_num;
+static Window win;
+static GC gc;
+static XFontStruct *fontinfo;
+static unsigned long black_pixel, white_pixel;
+
+/* The current listing: entry records, their name arena, metadata */
+static Entry *entries = NULL;
+static int nentries = 0;
+static int entries_cap = 0;
+static char *names = NULL;
+static size_t names_len = 0;
+static size_t names_cap = 0;
+static Meta *metas = NULL;
+static int nmetas = 0;
+static int metas_cap = 0;
+static struct stat cur_st;  /* the directory the listing belongs to */
+static time_t cur_stamp;    /* when its scan started */
+/*
+ * The listing in sort order. order[0, nsorted) is sorted; rows after
+ * that arrived during a scan and wait to be merged. Entries
+ * [0, view_ents) have been considered for it, deleted ones are left out.
+ * The rows on screen are view[0, nview): order[] itself, or the rows
+ * that match the filter, copied to filt[].
+ */
+static SortKey *order = NULL;
+static int norder = 0;
+static int order_cap = 0;           /* also the size of sort_tmp, filt */
+static int nsorted = 0;
+static int view_ents = 0;
+static int ntombs = 0;              /* E_DEAD entries in the listing */
+static SortKey *sort_tmp = NULL;    /* radix and merge scratch */
+static int sort_mode = SORT_NAME;
+static int sort_reverse = 0;
+static const char *sort_names[SORT_MODES] = {
+    "name", "natural", "size", "mtime", "type"
+};
+static SortKey *view = NULL;
+static int nview = 0;
+
+/*
+ * Type-to-filter. The query is kept case-folded and matched against
+ * folded[], a case-folded copy of the name arena at the same offsets,
+ * as a substring or, in fuzzy mode, as a subsequence.
+ */
+static SortKey *filt = NULL;
+static char filter[FILTER_MAX + 1];
+static int filter_len = 0;
+static int filter_fuzzy = 0;
+static char *folded = NULL;
+static size_t folded_len = 0;           /* bytes of names[] folded so far */
+static size_t folded_cap = 0;
+static unsigned char *marks = NULL;     /* per entry, for filter_all() */
+static int marks_cap = 0;
+static int selected = -1;   /* row, not entry */
+static int scroll_top = 0;  /* first row shown in the list */
+static Pixmap backbuf;      /* off-screen copy of the whole window */
+static Region damage;       /* backbuf area that has to be re-rendered */
+static Region present;      /* window area that has to be copied from backbuf */
+static int shown_top = 0;   /* scroll_top that backbuf was rendered at */
+static int dirty_first[DIRTY_MAX];  /* entry ranges to re-render, */
+static int dirty_last[DIRTY_MAX];   /* in entry indices not pixels */
+static int ndirty = 0;
+static int dirty_overflow = 0;
+static int dir_fd = -1;     /* open fd of cwd, used for lazy fstatat() */
+
+/*
+ * The way down to the open directory, as open fds: nav_fds[0] is the
+ * directory we started in (or went up to from there) at nav_base, and
+ * each further level was opened with openat() under the one before, so
+ * going in or out never walks a path from the root. Only the deepest
+ * NAV_FDS levels keep their fd; a closed one is found again through
+ * ".." of its child. The path string is only put together for the
+ * status line and for other programs, see cwd_path().
+ */
+#define NAV_FDS 64
+static int *nav_fds = NULL;         /* nav_fds[nav_depth - 1] is dir_fd */
+static char **nav_names = NULL;     /* the name each level was opened by */
+static int nav_depth = 0;
+static int nav_cap = 0;
+static char *nav_base = NULL;
+static char *cwd_title = NULL;      /* cwd_path(), when !cwd_stale */
+static size_t cwd_title_cap = 0;
+static int cwd_stale = 1;
+
+/*
+ * Background scanner. The UI bumps scan_gen and hands over a directory
+ * fd; the worker streams ScanBatches back and pokes wake_pipe. A worker
+ * that sees scan_gen move on drops its scan at once.
+ */
+static pthread_t scan_thread;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long scan_gen = 0;      /* atomic; newest requested scan */
+static int scan_req_fd = -1;            /* pending request, under scan_lock */
+static ScanBatch *scan_ready = NULL;    /* finished batches, under scan_lock */
+static ScanBatch **scan_ready_tail = &scan_ready;
+static ScanBatch *scan_free = NULL;     /* recycled batches, under scan_lock */
+static int scanning = 0;                /* UI side: current scan still running */
+static DirReader scan_reader = DIR_READER_INIT;     /* scanner thread's */
+static int wake_pipe[2] = { -1, -1 };
+
+/*
+ * LRU cache of listings we navigated away from, bounded by
+ * XFM_CACHE_MB megabytes (DEFAULT_CACHE_MB if unset).
+ */
+#define DEFAULT_CACHE_MB 32
+static Listing *cache_head = NULL;
+static Listing *cache_tail = NULL;
+static size_t cache_bytes = 0;
+static size_t cache_budget = 0;
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+
+/* Prefetcher thread and its hand-over, see prefetch_request() */
+static pthread_t prefetch_thread;
+static int prefetch_running = 0;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+/* under prefetch_lock */
+static PrefetchReq prefetch_req = { -1, 0, 0, { "" } };
+static Listing *prefetch_ready = NULL;          /* under prefetch_lock */
+static unsigned long prefetch_gen = 0;  /* atomic; bumped on leaving a dir */
+static size_t prefetch_bytes = 0;       /* of spec listings in the cache */
+static int prefetch_sel = -1;           /* entry the selection rests on */
+static int prefetch_sent = 0;           /* already asked for around it */
+static struct timespec prefetch_since;
+static struct stat root_st;
+static DirReader prefetch_reader = DIR_READER_INIT; /* prefetch thread's */
+
+/*
+ * Change notification for the open directory. Events are left queued in
+ * the kernel while a scan runs and then applied in bursts at most every
+ * WATCH_COALESCE_MS. name_hash maps names to entry indices so each
+ * event is found without a linear search.
+ */
+static int watch_fd = -1;
+static int watch_wd = -1;
+static int watch_armed = 0;             /* events seen, burst timer running */
+static struct timespec watch_due;
+static int *name_hash = NULL;           /* open addressing, -1 = empty */
+static int name_hash_cap = 0;           /* power of two */
+static int name_hash_n = 0;             /* entries [0, n) are indexed */
+
+/*
+ * Subtree indexer pool and goto mode. index_pending counts directories
+ * not yet listed plus batches not yet handed over, over all workers.
+ */
+static IndexDeque index_deques[INDEX_THREADS];
+static int index_nthreads = 0;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t index_cond = PTHREAD_COND_INITIALIZER;
+static int index_queued = 0;            /* tasks in the deques, index_lock */
+static int index_pending = 0;           /* atomic */
+static unsigned long index_gen = 0;     /* atomic; current walk */
+static ScanBatch *index_ready = NULL;   /* finished batches, under scan_lock */
+static ScanBatch **index_ready_tail = &index_ready;
+static dev_t index_dev;                 /* root of the kept index */
+static ino_t index_ino;
+static time_t index_stamp;              /* when its walk started */
+static int index_stale = 0;             /* the root changed under goto mode */
+static int index_walking = 0;
+static int goto_mode = 0;
+static Listing index_listing;           /* the index while not shown */
+static Listing dir_listing;             /* the directory while goto shows */
+static int dir_partial = 0;             /* it must be read again on leaving */
+
+/* Directory totals, by directory inode, and the jobs still counting */
+static SizeRec **size_table = NULL;
+static int size_buckets = 0;
+static int size_nrecs = 0;
+static SizeRec **size_running = NULL;
+static int nsize_running = 0;
+static int size_running_cap = 0;
+static unsigned long size_gen = 0;      /* atomic; bumped on leaving a dir */
+static unsigned long size_visit = 0;    /* bumped by every read_dir() */
+static struct timespec size_last_tick;
+
+/* Latency spans: histograms, the optional trace ring, the overlay */
+static Hist span_hist[SPANS];
+static const char *span_names[SPANS] = {
+    "scan", "meta", "sort", "filter", "draw", "input"
+};
+static TraceEv *trace = NULL;
+static unsigned long ntrace = 0;
+static long long trace_base;
+static char *trace_path = NULL;
+static char *stats_path = NULL;
+static int hud_on = 0;
+static int hud_dirty = 0;               /* the numbers moved */
+static long long scan_since;            /* when the current scan began */
+static long long input_since = -1;      /* first input not yet shown */
+
+/* Preview pane, its thread and its layouts, see preview_timeout() */
+static int preview_on = 0;
+static pthread_t preview_thread;
+static int preview_running = 0;
+static pthread_mutex_t preview_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t preview_cond = PTHREAD_COND_INITIALIZER;
+static PreviewReq preview_req = { -1, 0, NULL };    /* under preview_lock */
+static Preview *preview_ready = NULL;               /* under preview_lock */
+static unsigned long preview_gen = 0;   /* atomic; bumped as the selection moves */
+static Preview preview_cache[PREVIEW_CACHE];
+static unsigned long preview_clock = 0;
+static Preview *preview_cur = NULL;     /* shown, in preview_cache[] */
+static int preview_sel = -1;            /* entry it is about */
+static int preview_sent = 0;            /* nothing more to ask for it */
+static struct timespec preview_since;
+
+/*
+ * Magic numbers, compiled by sniff_compile() into groups by first byte.
+ * Longer signatures win over shorter ones with the same start.
+ */
+static const SniffSig sniff_sigs[] = {
+    { 0, 4, FT_ELF, "\x7f" "ELF" },
+    { 0, 2, FT_SCRIPT, "#!" },
+    { 0, 2, FT_EXE, "MZ" },
+    { 0, 4, FT_EXE, "\xca\xfe\xba\xbe" },
+    { 0, 4, FT_EXE, "\xcf\xfa\xed\xfe" },
+    { 0, 4, FT_EXE, "\0asm" },
+    { 0, 8, FT_IMAGE, "\x89PNG\r\n\x1a\n" },
+    { 0, 3, FT_IMAGE, "\xff\xd8\xff" },
+    { 0, 4, FT_IMAGE, "GIF8" },
+    { 0, 4, FT_IMAGE, "II*\0" },
+    { 0, 4, FT_IMAGE, "MM\0*" },
+    { 0, 4, FT_IMAGE, "\0\0\1\0" },
+    { 8, 4, FT_IMAGE, "WEBP" },
+    { 0, 3, FT_AUDIO, "ID3" },
+    { 0, 4, FT_AUDIO, "fLaC" },
+    { 0, 4, FT_AUDIO, "OggS" },
+    { 8, 4, FT_AUDIO, "WAVE" },
+    { 4, 4, FT_VIDEO, "ftyp" },
+    { 0, 4, FT_VIDEO, "\x1a\x45\xdf\xa3" },
+    { 8, 4, FT_VIDEO, "AVI " },
+    { 0, 4, FT_ARCHIVE, "PK\3\4" },
+    { 0, 4, FT_ARCHIVE, "PK\5\6" },
+    { 0, 6, FT_ARCHIVE, "7z\xbc\xaf\x27\x1c" },
+    { 0, 6, FT_ARCHIVE, "Rar!\x1a\x07" },
+    { 0, 8, FT_ARCHIVE, "!<arch>\n" },
+    { 257, 5, FT_ARCHIVE, "ustar" },
+    { 0, 6, FT_ARCHIVE, "070707" },
+    { 0, 6, FT_ARCHIVE, "070701" },
+    { 0, 2, FT_COMPRESSED, "\x1f\x8b" },
+    { 0, 3, FT_COMPRESSED, "BZh" },
+    { 0, 6, FT_COMPRESSED, "\xfd" "7zXZ\0" },
+    { 0, 4, FT_COMPRESSED, "\x28\xb5\x2f\xfd" },
+    { 0, 4, FT_COMPRESSED, "\x04\x22\x4d\x18" },
+    { 0, 2, FT_COMPRESSED, "\x1f\x9d" },
+    { 0, 5, FT_DOCUMENT, "%PDF-" },
+    { 0, 4, FT_DOCUMENT, "%!PS" },
+    { 0, 8, FT_DOCUMENT, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1" },
+    { 0, 5, FT_DOCUMENT, "{\\rtf" },
+    { 0, 16, FT_DATABASE, "SQLite format 3\0" }
+};
+#define NSIGS ((int)(sizeof(sniff_sigs) / sizeof(sniff_sigs[0])))
+static const char *ftype_names[] = {
+    "", "", "empty", "text", "script", "ELF", "exe", "image", "audio",
+    "video", "archive", "compress", "doc", "db", "data", "?"
+};
+static unsigned char sniff_by_byte[NSIGS];  /* offset 0, by first byte */
+static int sniff_first[257];    /* byte b: sniff_by_byte[first[b], first[b+1]) */
+static unsigned char sniff_rest[NSIGS];     /* at other offsets */
+static int sniff_nrest = 0;
+static int sniff_compiled = 0;
+static TypeRec type_cache[TYPE_CACHE];
+static SniffBatch *sniff_pending = NULL;    /* being filled by draw_row() */
+static pthread_mutex_t sniff_lock = PTHREAD_MUTEX_INITIALIZER;
+static SniffBatch *sniff_ready = NULL;      /* under sniff_lock */
+static unsigned long sniff_gen = 0;     /* atomic; bumped by sniff_drop() */
+
+/* Copy, move and delete jobs, see fileop_main() */
+static pthread_t fileop_threads[FILEOP_THREADS];
+static int fileop_running = 0;
+static pthread_mutex_t fileop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fileop_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t del_cond = PTHREAD_COND_INITIALIZER;  /* Job.walked */
+static const char *job_ops[] = { "copy", "move", "delete" };
+static Job *jobs = NULL;                /* oldest first, under fileop_lock */
+static int njobs = 0;                   /* UI side: queued or on show */
+static char *clip_path = NULL;          /* marked by Ctrl-C or Ctrl-X */
+static int clip_op = JOB_COPY;
+static char *confirm_path = NULL;       /* Delete asked about, until a key */
+static struct timespec jobs_last_tick;
+
+/* Double-click detection */
+static Time last_click_time = 0;
+static int last_click_index = -1;
+
+/* External viewer command */
+#define DEFAULT_VIEWER "xterm -e vi"
+static char *viewer_argv[16];
+
+/* Viewers we started and have not reaped yet */
+typedef struct Launch {
+    pid_t pid;
+    char name[64];
+} Launch;
+static Launch *launches = NULL;
+static int nlaunches = 0;
+static int launches_cap = 0;
+static char status_msg[160];    /* shown in the status line until a key */
+
+extern char **environ;
+
+/* Forward declarations */
+static void setup_viewer(void);
+static void read_dir(void);
+static int nav_push(int fd, const char *name, size_t len);
+static void nav_pop(void);
+static void nav_open(const char *path);
+static int nav_enter(const char *path);
+static void nav_up(void);
+static const char *cwd_path(void);
+static char *entry_path(int idx);
+static const char *entry_name(int idx);
+static int listing_reserve(int n, size_t bytes);
+static int listing_add(const char *name, size_t len, int flags);
+static size_t listing_bytes(const Listing *l);
+static void listing_stash(Listing *l);
+static void listing_adopt(Listing *l);
+static void setup_cache(void);
+static void cache_unlink(Listing *l);
+static void cache_evict(void);
+static void cache_store(void);
+static int cache_take(const struct stat *st);
+static int classify_dir(int dfd, const struct dirent *de);
+static int dir_open(DirReader *r, int fd);
+static struct dirent *dir_next(DirReader *r);
+static void dir_close(DirReader *r);
+static void scan_start(void);
+static void *scan_main(void *arg);
+static void scan_post(ScanBatch *b);
+static ScanBatch *scan_batch_get(unsigned long gen);
+static void scan_batch_put(ScanBatch *b);
+static int scan_collect(void);
+static void listing_take(ScanBatch *b);
+static int prefetch_start(void);
+static void *prefetch_main(void *arg);
+static int prefetch_add(Listing *l, const char *name, size_t len, int flags);
+static void prefetch_free(Listing *l);
+static Listing *prefetch_read(int dfd, const char *name, unsigned long gen);
+static int prefetch_cached(int idx);
+static void prefetch_request(void);
+static int prefetch_timeout(const struct timespec *now);
+static void prefetch_collect(void);
+static int preview_start(void);
+static void *preview_main(void *arg);
+static Preview *preview_read(const PreviewReq *req);
+static void preview_layout(Preview *p, const unsigned char *buf, size_t n);
+static Preview *preview_find(dev_t dev, ino_t ino, time_t mtime);
+static Preview *preview_store(const Preview *p);
+static int preview_timeout(const struct timespec *now);
+static void preview_collect(void);
+static void draw_preview(void);
+static IndexDir *index_dir_new(IndexDir *parent, const char *path,
+                               size_t len, size_t name_off);
+static void index_release(IndexDir *d);
+static void index_finish(void);
+static int index_push(int w, IndexDir *d);
+static IndexDir *index_take(int w);
+static void index_post(ScanBatch *b);
+static void index_walk(int w, IndexDir *d, ScanBatch **bp);
+static void *index_main(void *arg);
+static int index_start(void);
+static void index_begin(void);
+static int index_fresh(void);
+static int index_collect(void);
+static void goto_enter(void);
+static void sniff_compile(void);
+static int sniff_match(const unsigned char *buf, size_t n);
+static void sniff_run(IndexDir *d);
+static TypeRec *type_slot(dev_t dev, ino_t ino);
+static int sniff_type(int idx, Meta *m);
+static void sniff_flush(void);
+static void sniff_drop(void);
+static void sniff_collect(void);
+static int size_seen(SizeJob *job, dev_t dev, ino_t ino);
+static void size_job_release(SizeJob *job);
+static void size_task_end(SizeJob *job);
+static void size_walk(int w, IndexDir *d);
+static SizeRec *size_find(dev_t dev, ino_t ino);
+static SizeRec *size_add(dev_t dev, ino_t ino);
+static long long size_of_dir(int idx, int *partial);
+static int size_collect(void);
+static void size_cancel(void);
+static int size_tick(const struct timespec *now);
+static void format_size(char *buf, long long n);
+static int fileop_start(void);
+static void *fileop_main(void *arg);
+static int fileop_run(Job *j);
+static int fileop_parent(const char *path);
+static long long fileop_measure(Job *j, int dfd, const char *name);
+static int fileop_copy(Job *j, int sfd, const char *sname, int dfd,
+                       const char *dname);
+static int fileop_copy_file(Job *j, int in, int out, off_t size);
+static int fileop_remove(int dfd, const char *name);
+static int fileop_delete(Job *j);
+static void del_fail(Job *j, int err);
+static void del_walk(int w, IndexDir *d);
+static void del_release(IndexDir *d);
+static void job_add(int op, const char *src, const char *dst);
+static void jobs_cancel(void);
+static int jobs_tick(const struct timespec *now);
+static void jobs_collect(void);
+static char *selection_path(void);
+static void clip_mark(int op);
+static void delete_ask(void);
+static void draw_jobs(void);
+static void goto_leave(int away);
+static Meta *entry_meta(int idx);
+static int fold_cmp(const char *a, const char *b);
+static int natural_cmp(const char *a, const char *b);
+static unsigned long long fold_prefix(const char *s, size_t len, size_t from);
+static unsigned long long natural_prefix(const char *s, size_t len);
+static const char *name_ext(int idx);
+static int is_dotdot(int idx);
+static unsigned long long sort_key(int idx);
+static int sort_cmp_entries(int a, int b);
+static int sort_cmp(const void *a, const void *b);
+static void radix_sort(SortKey *a, int n);
+static void sort_run(SortKey *a, int n, size_t depth);
+static void sort_keys(SortKey *a, int n);
+static int view_reserve(int n);
+static void view_clear(void);
+static void view_append(void);
+static int view_merge(void);
+static int view_show(int first, int from);
+static void view_changed(int first, int old, int sel);
+static void view_sync(void);
+static void view_resort(void);
+static void listing_compact(void);
+static int fold_sync(void);
+static long find_folded(const char *h, size_t n, const char *q, size_t qlen);
+static int filter_match(int idx);
+static void filter_rows(const SortKey *a, int n);
+static void filter_all(void);
+static void filter_update(int narrowed);
+static unsigned int name_hash_of(const char *name, size_t len);
+static void name_index_add(int idx);
+static void name_index_sync(void);
+static int name_lookup(const char *name, size_t len);
+static void watch_start(void);
+static void watch_dir(int fd);
+static int watch_timeout(const struct timespec *now);
+static void watch_apply(void);
+static void draw_list(void);
+static void draw_row(int idx);
+static void draw_status(void);
+static void damage_rect(int x, int y, int w, int h);
+static void damage_rows(int first, int last);
+static void damage_all(void);
+static void render_damage(void);
+static void sync_scroll(void);
+static int draw_pending(void);
+static void reset_view(void);
+static int scroll_to(int top);
+static void scroll_by(int delta);
+static void select_index(int idx);
+static void open_entry(int idx);
+static int y_to_index(int y);
+static void handle_event(XEvent *ev);
+static long elapsed_ms(const struct timespec *a, const struct timespec *b);
+static void sigchld_handler(int sig);
+static void launch(const char *path);
+static void status_set(const char *fmt, ...);
+static void status_error(const char *fmt, ...);
+static void launch_reap(void);
+static long long now_us(void);
+static void span_end(int span, long long start);
+static long long hist_pct(const Hist *h, int p);
+static void setup_trace(void);
+static void trace_dump(void);
+static void draw_hud(void);
+
+/* Utility: set viewer argv from env or default */
+static void setup_viewer(void)
+{
+    char *env = getenv("FILE_VIEWER");
+    char buf[512];
+    char *p;
+    int i = 0;
+
+    if (env && env[0] != '\0') {
+        strncpy(buf, env, sizeof(buf)-1);
+        buf[sizeof(buf)-1] = '\0';
+    } else {
+        strncpy(buf, DEFAULT_VIEWER, sizeof(buf)-1);
+        buf[sizeof(buf)-1] = '\0';
+    }
+
+    p = strtok(buf, " \t");
+    while (p != NULL && i < 15) {
+        viewer_argv[i] = strdup(p);
+        i++;
+        p = strtok(NULL, " \t");
+    }
+    viewer_argv[i] = NULL;
+}
+
+/*
+ * Decide whether a dirent is a directory without a stat() when the
+ * filesystem fills in d_type. Symlinks and DT_UNKNOWN still need a
+ * fstatat() relative to the open directory, which follows the link
+ * the same way stat() on the full path used to.
+ */
+static int classify_dir(int dfd, const struct dirent *de)
+{
+    struct stat st;
+
+#ifdef DT_UNKNOWN
+    if (de->d_type == DT_DIR) return 1;
+    if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK) return 0;
+#endif
+    if (fstatat(dfd, de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode))
+        return 1;
+    return 0;
+}
+
+/*
+ * Directory reading without readdir(): getdents64() fills one large
+ * buffer straight from the kernel and dir_next() walks its records in
+ * place, so a name is only copied by whoever keeps it. With
+ * DIRBUF_BYTES at a time a million entries take a few dozen calls
+ * where glibc's 32K DIR buffer needs about a thousand, and the buffer
+ * is reused from one directory to the next. Elsewhere these are thin
+ * wrappers around fdopendir() and readdir().
+ */
+
+/* Start reading the directory fd, which r then owns; -1 on failure */
+static int dir_open(DirReader *r, int fd)
+{
+#ifdef HAVE_GETDENTS64
+    if (r->buf == NULL && (r->buf = (char*)malloc(DIRBUF_BYTES)) == NULL) {
+        return -1;
+    }
+    r->len = 0;
+    r->pos = 0;
+#else
+    r->dir = fdopendir(fd);
+    if (r->dir == NULL) return -1;
+#endif
+    r->fd = fd;
+    r->calls = 0;
+    return 0;
+}
+
+/* The next record, '.' and '..' included; NULL at the end or on error */
+static struct dirent *dir_next(DirReader *r)
+{
+#ifdef HAVE_GETDENTS64
+    struct dirent *de;
+
+    if (r->pos >= r->len) {
+        r->len = syscall(SYS_getdents64, r->fd, r->buf, DIRBUF_BYTES);
+        r->pos = 0;
+        r->calls++;
+        if (r->len <= 0) return NULL;
+    }
+    de = (struct dirent*)(r->buf + r->pos);
+    r->pos += de->d_reclen;
+    return de;
+#else
+    r->calls++;
+    return readdir(r->dir);
+#endif
+}
+
+/* Close the directory; the buffer stays for the next one */
+static void dir_close(DirReader *r)
+{
+#ifdef HAVE_GETDENTS64
+    close(r->fd);
+#else
+    closedir(r->dir);
+#endif
+    r->fd = -1;
+}
+
+/* Name of entry idx, NUL-terminated inside the arena */
+static const char *entry_name(int idx)
+{
+    return names + entries[idx].name_off;
+}
+
+/*
+ * Make room for n more entries with bytes more of names. The arrays
+ * only ever grow; a new directory just starts writing at 0 again.
+ */
+static int listing_reserve(int n, size_t bytes)
+{
+    Entry *etmp;
+    char *ntmp;
+    int ecap;
+    size_t ncap;
+
+    if (nentries + n > entries_cap) {
+        ecap = entries_cap ? entries_cap : SCAN_BATCH;
+        while (nentries + n > ecap) ecap *= 2;
+        etmp = (Entry*)realloc(entries, sizeof(Entry) * ecap);
+        if (!etmp) return -1;
+        entries = etmp;
+        entries_cap = ecap;
+    }
+    if (names_len + bytes > names_cap) {
+        ncap = names_cap ? names_cap : SCAN_BATCH_NAMES;
+        while (names_len + bytes > ncap) ncap *= 2;
+        ntmp = (char*)realloc(names, ncap);
+        if (!ntmp) return -1;
+        names = ntmp;
+        names_cap = ncap;
+    }
+    return 0;
+}
+
+/* Append one entry to the listing */
+static int listing_add(const char *name, size_t len, int flags)
+{
+    Entry *e;
+
+    if (listing_reserve(1, len + 1) < 0) return -1;
+    e = &entries[nentries++];
+    e->name_off = names_len;
+    e->name_len = len;
+    e->flags = flags;
+    e->meta = -1;
+    memcpy(names + names_len, name, len + 1);
+    names_len += len + 1;
+    return 0;
+}
+
+/* Heap memory held by a listing */
+static size_t listing_bytes(const Listing *l)
+{
+    return sizeof(Listing) + l->entries_cap * sizeof(Entry) +
+           l->names_cap + l->metas_cap * sizeof(Meta);
+}
+
+/*
+ * Move the current listing's arrays into l; the globals are left empty.
+ * Sniffs in flight name slots of the metas going away, so they are
+ * dropped; goto_enter() and goto_leave() swap listings this way too.
+ */
+static void listing_stash(Listing *l)
+{
+    sniff_drop();
+    l->entries = entries;
+    l->nentries = nentries;
+    l->entries_cap = entries_cap;
+    l->names = names;
+    l->names_len = names_len;
+    l->names_cap = names_cap;
+    l->metas = metas;
+    l->nmetas = nmetas;
+    l->metas_cap = metas_cap;
+    entries = NULL;
+    nentries = entries_cap = 0;
+    names = NULL;
+    names_len = names_cap = 0;
+    metas = NULL;
+    nmetas = metas_cap = 0;
+}
+
+/* Make l's arrays the current listing, dropping the current ones */
+static void listing_adopt(Listing *l)
+{
+    free(entries);
+    free(names);
+    free(metas);
+    entries = l->entries;
+    nentries = l->nentries;
+    entries_cap = l->entries_cap;
+    names = l->names;
+    names_len = l->names_len;
+    names_cap = l->names_cap;
+    metas = l->metas;
+    nmetas = l->nmetas;
+    metas_cap = l->metas_cap;
+    l->entries = NULL;
+    l->names = NULL;
+    l->metas = NULL;
+}
+
+/* Utility: set the listing cache budget from env or default */
+static void setup_cache(void)
+{
+    char *env = getenv("XFM_CACHE_MB");
+    long mb = DEFAULT_CACHE_MB;
+
+    if (env && env[0] != '\0') {
+        mb = atol(env);
+        if (mb < 0) mb = 0;
+    }
+    cache_budget = (size_t)mb << 20;
+}
+
+static void cache_unlink(Listing *l)
+{
+    if (l->prev) l->prev->next = l->next; else cache_head = l->next;
+    if (l->next) l->next->prev = l->prev; else cache_tail = l->prev;
+    l->prev = l->next = NULL;
+    cache_bytes -= listing_bytes(l);
+    if (l->spec) prefetch_bytes -= listing_bytes(l);
+}
+
+/*
+ * Drop least recently used listings until we are within budget. If the
+ * current listing has no memory of its own (it was just stashed), the
+ * first victim's arrays are recycled for it instead of freed.
+ */
+static void cache_evict(void)
+{
+    Listing *l;
+
+    while (cache_bytes > cache_budget && cache_tail != NULL) {
+        l = cache_tail;
+        cache_unlink(l);
+        if (entries == NULL) {
+            listing_adopt(l);
+            nentries = 0;
+            names_len = 0;
+            nmetas = 0;
+        } else {
+            free(l->entries);
+            free(l->names);
+            free(l->metas);
+        }
+        free(l);
+    }
+}
+
+/* Keep the current listing, if it is complete, before leaving it */
+static void cache_store(void)
+{
+    Listing *l;
+
+    if (scanning || dir_fd < 0 || nentries == 0 || cache_budget == 0) return;
+
+    for (l = cache_head; l != NULL; l = l->next) {
+        if (l->dev == cur_st.st_dev && l->ino == cur_st.st_ino) break;
+    }
+    if (l != NULL) {
+        cache_unlink(l);
+        free(l->entries);
+        free(l->names);
+        free(l->metas);
+    } else {
+        l = (Listing*)malloc(sizeof(Listing));
+        if (l == NULL) return;
+    }
+
+    l->dev = cur_st.st_dev;
+    l->ino = cur_st.st_ino;
+    l->mtime = cur_st.st_mtime;
+    l->ctime = cur_st.st_ctime;
+    l->stamp = cur_stamp;
+    l->spec = 0;
+    listing_stash(l);
+
+    l->prev = NULL;
+    l->next = cache_head;
+    if (cache_head) cache_head->prev = l; else cache_tail = l;
+    cache_head = l;
+    cache_bytes += listing_bytes(l);
+    cache_evict();
+}
+
+/*
+ * Look up the directory described by st. A still valid listing becomes
+ * the current one and we return 1. A stale one is thrown away, though
+ * its memory is reused when the current listing has none.
+ */
+static int cache_take(const struct stat *st)
+{
+    Listing *l;
+    int valid;
+    int i;
+
+    for (l = cache_head; l != NULL; l = l->next) {
+        if (l->dev == st->st_dev && l->ino == st->st_ino) break;
+    }
+    if (l == NULL) {
+        cache_misses++;
+        return 0;
+    }
+
+    cache_unlink(l);
+    /* a change in the same second as the scan would not show in mtime */
+    valid = l->mtime == st->st_mtime && l->ctime == st->st_ctime &&
+            l->mtime < l->stamp && l->ctime < l->stamp;
+    if (valid || entries == NULL) {
+        listing_adopt(l);
+    } else {
+        free(l->entries);
+        free(l->names);
+        free(l->metas);
+    }
+    if (valid) {
+        cur_stamp = l->stamp;
+        /* file sizes and times may have moved on; stat again on demand */
+        for (i = 0; i < nentries; i++) entries[i].meta = -1;
+        nmetas = 0;
+        cache_hits++;
+    } else {
+        nentries = 0;
+        names_len = 0;
+        nmetas = 0;
+        cache_misses++;
+    }
+    free(l);
+    return valid;
+}
+
+/*
+ * Start reading the open directory, dir_fd. A valid cached listing is
+ * used as it is; otherwise the listing is reset to just ".." and the
+ * rest streams in through scan_collect() as the worker reads it.
+ */
+static void read_dir(void)
+{
+    int fd;
+
+    /* park the listing we are leaving in the cache */
+    cache_store();
+    size_cancel();
+    size_visit++;
+    __atomic_add_fetch(&prefetch_gen, 1, __ATOMIC_RELEASE);
+    prefetch_sel = -1;
+    preview_sel = -1;
+    sniff_drop();
+
+    /* reset, keep the memory for the next directory */
+    view_clear();
+    name_hash_n = 0;
+    nentries = 0;
+    names_len = 0;
+    nmetas = 0;
+
+    /* cancel whatever the worker is still doing */
+    pthread_mutex_lock(&scan_lock);
+    __atomic_add_fetch(&scan_gen, 1, __ATOMIC_RELEASE);
+    if (scan_req_fd >= 0) close(scan_req_fd);
+    scan_req_fd = -1;
+    pthread_mutex_unlock(&scan_lock);
+    scanning = 0;
+
+    if (dir_fd < 0) return;
+    /* watch before reading so nothing slips between scan and watch */
+    watch_dir(dir_fd);
+
+    scan_since = now_us();
+    if (fstat(dir_fd, &cur_st) == 0 && cache_take(&cur_st)) {
+        view_sync();
+        span_end(SPAN_SCAN, scan_since);
+        return;
+    }
+    cur_stamp = time(NULL);
+
+    /* include .. for going up, unless we are at root */
+    if (cur_st.st_dev != root_st.st_dev || cur_st.st_ino != root_st.st_ino) {
+        listing_add("..", 2, E_DIR);
+    }
+
+    /*
+     * The worker gets its own open of the directory, not a dup(): that
+     * would share the offset, which a read of the same dir_fd before
+     * left at the end.
+     */
+    fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    pthread_mutex_lock(&scan_lock);
+    scan_req_fd = fd;
+    pthread_cond_signal(&scan_cond);
+    pthread_mutex_unlock(&scan_lock);
+    scanning = 1;
+}
+
+/* Put fd, opened by name under dir_fd, on top of the way down */
+static int nav_push(int fd, const char *name, size_t len)
+{
+    int *fds;
+    char **names;
+    char *copy;
+    int cap;
+
+    if (nav_depth == nav_cap) {
+        cap = nav_cap ? nav_cap * 2 : 16;
+        fds = (int*)realloc(nav_fds, cap * sizeof(int));
+        if (fds == NULL) return -1;
+        nav_fds = fds;
+        names = (char**)realloc(nav_names, cap * sizeof(char*));
+        if (names == NULL) return -1;
+        nav_names = names;
+        nav_cap = cap;
+    }
+    copy = (char*)malloc(len + 1);
+    if (copy == NULL) return -1;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    /* only the deepest NAV_FDS levels stay open */
+    if (nav_depth >= NAV_FDS && nav_fds[nav_depth - NAV_FDS] >= 0) {
+        close(nav_fds[nav_depth - NAV_FDS]);
+        nav_fds[nav_depth - NAV_FDS] = -1;
+    }
+    nav_fds[nav_depth] = fd;
+    nav_names[nav_depth] = copy;
+    nav_depth++;
+    dir_fd = fd;
+    cwd_stale = 1;
+    return 0;
+}
+
+/* Back to the directory we came down from, even through a symlink */
+static void nav_pop(void)
+{
+    int fd = nav_fds[nav_depth - 1];
+
+    nav_depth--;
+    free(nav_names[nav_depth]);
+    if (nav_fds[nav_depth - 1] < 0) {
+        nav_fds[nav_depth - 1] =
+            openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd >= 0) close(fd);
+    dir_fd = nav_fds[nav_depth - 1];
+    cwd_stale = 1;
+}
+
+/* Make path the open directory, forgetting the way there, and read it */
+static void nav_open(const char *path)
+{
+    char *base = strdup(path);
+    size_t len;
+    int fd;
+
+    if (base == NULL) return;
+    len = strlen(base);
+    while (len > 1 && base[len - 1] == '/') base[--len] = '\0';
+
+    while (nav_depth > 0) {
+        nav_depth--;
+        if (nav_fds[nav_depth] >= 0) close(nav_fds[nav_depth]);
+        free(nav_names[nav_depth]);
+    }
+    dir_fd = -1;
+    free(nav_base);
+    nav_base = base;
+    cwd_stale = 1;
+
+    stat("/", &root_st);
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) perror("opendir");
+    if (nav_push(fd, "", 0) < 0 && fd >= 0) close(fd);
+    read_dir();
+}
+
+/*
+ * Go down into path, relative to the open directory; in goto mode it
+ * may be several levels, which are opened one at a time so that ".."
+ * later comes back through each. Nothing changes if one will not open.
+ */
+static int nav_enter(const char *path)
+{
+    char name[NAME_MAX + 1];
+    const char *p = path;
+    size_t len;
+    int depth = nav_depth;
+    int err = 0;
+    int fd;
+
+    while (*p != '\0' && err == 0) {
+        len = strcspn(p, "/");
+        if (len > NAME_MAX) {
+            err = ENAMETOOLONG;
+        } else if (len > 0) {
+            memcpy(name, p, len);
+            name[len] = '\0';
+            fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                err = errno;
+            } else if (nav_push(fd, name, len) < 0) {
+                close(fd);
+                err = ENOMEM;
+            }
+        }
+        p += len;
+        if (*p == '/') p++;
+    }
+    if (err == 0) return 0;
+
+    while (nav_depth > depth) nav_pop();
+    status_error("%s: %s", path, strerror(err));
+    return -1;
+}
+
+/* Go up: the way we came, or past where we started the real parent */
+static void nav_up(void)
+{
+    char *base;
+    char *p;
+    size_t len;
+    int fd;
+
+    if (nav_depth > 1) {
+        nav_pop();
+        return;
+    }
+    fd = openat(dir_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        status_error("..: %s", strerror(errno));
+        return;
+    }
+    close(dir_fd);
+    nav_fds[0] = dir_fd = fd;
+    cwd_stale = 1;
+
+    /* the parent of nav_base, or nav_base/.. when it has no last name */
+    p = strrchr(nav_base, '/');
+    if (p != NULL && strcmp(p + 1, ".") != 0 && strcmp(p + 1, "..") != 0) {
+        if (p == nav_base) p[1] = '\0'; else *p = '\0';
+        return;
+    }
+    len = strlen(nav_base);
+    base = (char*)realloc(nav_base, len + 4);
+    if (base == NULL) return;
+    strcpy(base + len, "/..");
+    nav_base = base;
+}
+
+/*
+ * The open directory as a path: nav_base and the names down from it,
+ * put together only when something wants to show or hand it on.
+ */
+static const char *cwd_path(void)
+{
+    size_t need;
+    size_t len;
+    char *title;
+    int i;
+
+    if (!cwd_stale) return cwd_title;
+    need = strlen(nav_base) + 1;
+    for (i = 1; i < nav_depth; i++) need += strlen(nav_names[i]) + 1;
+    if (need > cwd_title_cap) {
+        title = (char*)realloc(cwd_title, need);
+        if (title == NULL) return nav_base;
+        cwd_title = title;
+        cwd_title_cap = need;
+    }
+
+    strcpy(cwd_title, nav_base);
+    len = strlen(cwd_title);
+    for (i = 1; i < nav_depth; i++) {
+        if (len == 0 || cwd_title[len - 1] != '/') cwd_title[len++] = '/';
+        strcpy(cwd_title + len, nav_names[i]);
+        len += strlen(nav_names[i]);
+    }
+    cwd_stale = 0;
+    return cwd_title;
+}
+
+/* Full path of an entry of the open directory, malloc'ed */
+static char *entry_path(int idx)
+{
+    const char *dir = cwd_path();
+    const char *name = entry_name(idx);
+    size_t len = strlen(dir);
+    char *path;
+
+    path = (char*)malloc(len + strlen(name) + 2);
+    if (path == NULL) return NULL;
+    sprintf(path, "%s%s%s", dir, len > 0 && dir[len - 1] == '/' ? "" : "/",
+            name);
+    return path;
+}
+
+/* Create the wake-up pipe and the scanner thread */
+static void scan_start(void)
+{
+    if (pipe(wake_pipe) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    if (pthread_create(&scan_thread, NULL, scan_main, NULL) != 0) {
+        fprintf(stderr, "Unable to start scanner thread.\n");
+        exit(1);
+    }
+}
+
+/* Queue a batch for the UI and wake the event loop */
+static void scan_post(ScanBatch *b)
+{
+    pthread_mutex_lock(&scan_lock);
+    b->next = NULL;
+    *scan_ready_tail = b;
+    scan_ready_tail = &b->next;
+    pthread_mutex_unlock(&scan_lock);
+    /* a full pipe already means a wake-up is pending */
+    if (write(wake_pipe[1], "s", 1) < 0 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+/* Take an empty batch off the free list, or allocate one */
+static ScanBatch *scan_batch_get(unsigned long gen)
+{
+    ScanBatch *b;
+
+    pthread_mutex_lock(&scan_lock);
+    b = scan_free;
+    if (b != NULL) scan_free = b->next;
+    pthread_mutex_unlock(&scan_lock);
+
+    if (b == NULL) {
+        b = (ScanBatch*)malloc(sizeof(ScanBatch));
+        if (b == NULL) return NULL;
+    }
+    b->next = NULL;
+    b->gen = gen;
+    b->n = 0;
+    b->done = 0;
+    b->names_len = 0;
+    return b;
+}
+
+/* Give a consumed batch back for reuse */
+static void scan_batch_put(ScanBatch *b)
+{
+    pthread_mutex_lock(&scan_lock);
+    b->next = scan_free;
+    scan_free = b;
+    pthread_mutex_unlock(&scan_lock);
+}
+
+/* Scanner thread: read one directory at a time, batch by batch */
+static void *scan_main(void *arg)
+{
+    struct dirent *de;
+    ScanBatch *b;
+    unsigned long gen;
+    int fd;
+    size_t len;
+    Entry *e;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&scan_lock);
+        while (scan_req_fd < 0) {
+            pthread_cond_wait(&scan_cond, &scan_lock);
+        }
+        fd = scan_req_fd;
+        scan_req_fd = -1;
+        gen = __atomic_load_n(&scan_gen, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&scan_lock);
+
+        b = scan_batch_get(gen);
+        if (b == NULL) {
+            close(fd);
+            continue;
+        }
+
+        if (dir_open(&scan_reader, fd) < 0) {
+            perror("dir_open");
+            close(fd);
+            b->done = 1;
+            scan_post(b);
+            continue;
+        }
+
+        while ((de = dir_next(&scan_reader)) != NULL) {
+            /* stale: the user has already moved on */
+            if (__atomic_load_n(&scan_gen, __ATOMIC_ACQUIRE) != gen) break;
+
+            /* skip '.', and '..' which read_dir() already added */
+            if (strcmp(de->d_name, ".") == 0) continue;
+            if (strcmp(de->d_name, "..") == 0) continue;
+
+            len = strlen(de->d_name);
+            if (b->names_len + len + 1 > SCAN_BATCH_NAMES) {
+                scan_post(b);
+                b = scan_batch_get(gen);
+                if (b == NULL) break; /* OOM */
+            }
+
+            e = &b->ents[b->n];
+            e->name_off = b->names_len;
+            e->name_len = len;
+            e->flags = classify_dir(fd, de) ? E_DIR : 0;
+            e->meta = -1;
+            memcpy(b->names + b->names_len, de->d_name, len + 1);
+            b->names_len += len + 1;
+            b->n++;
+
+            if (b->n == SCAN_BATCH) {
+                scan_post(b);
+                b = scan_batch_get(gen);
+                if (b == NULL) break; /* OOM */
+            }
+        }
+        dir_close(&scan_reader);
+
+        if (b != NULL) {
+            b->done = 1;
+            scan_post(b);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Append finished batches to the listing and let the view place them.
+ * Batches of an abandoned scan are dropped. Either way they go back to
+ * the free list. Returns nonzero if anything visible changed.
+ */
+static int scan_collect(void)
+{
+    char buf[64];
+    ScanBatch *list, *b;
+    unsigned long gen;
+    int old = nentries;
+
+    while (read(wake_pipe[0], buf, sizeof(buf)) > 0) {
+        /* drain */
+    }
+
+    pthread_mutex_lock(&scan_lock);
+    list = scan_ready;
+    scan_ready = NULL;
+    scan_ready_tail = &scan_ready;
+    pthread_mutex_unlock(&scan_lock);
+
+    gen = __atomic_load_n(&scan_gen, __ATOMIC_ACQUIRE);
+    while (list != NULL) {
+        b = list;
+        list = b->next;
+
+        if (b->gen != gen || dir_fd < 0) {
+            scan_batch_put(b);
+            continue;
+        }
+
+        listing_take(b);
+        if (b->done) {
+            scanning = 0;
+            span_end(SPAN_SCAN, scan_since);
+        }
+        scan_batch_put(b);
+    }
+
+    if (nentries == old && scanning) return 0;
+    /* the last batch also lets the view merge what is still unsorted */
+    view_sync();
+    return 1;
+}
+
+/* Append a batch's entries and names to the listing */
+static void listing_take(ScanBatch *b)
+{
+    size_t base;
+    int i;
+
+    if (listing_reserve(b->n, b->names_len) < 0) return;
+    base = names_len;
+    memcpy(names + base, b->names, b->names_len);
+    names_len += b->names_len;
+    for (i = 0; i < b->n; i++) {
+        entries[nentries] = b->ents[i];
+        entries[nentries].name_off += base;
+        nentries++;
+    }
+}
+
+/* Fetch mode/size/mtime for one entry the first time it is needed */
+static Meta *entry_meta(int idx)
+{
+    Entry *e;
+    Meta *m, *tmp;
+    struct stat st;
+    long long t;
+    int ok;
+
+    if (idx < 0 || idx >= nentries) return NULL;
+    e = &entries[idx];
+    if (e->meta >= 0) return &metas[e->meta];
+
+    if (nmetas == metas_cap) {
+        tmp = (Meta*)realloc(metas, sizeof(Meta) *
+                             (metas_cap ? metas_cap * 2 : LIST_ROWS * 4));
+        if (!tmp) return NULL;
+        metas = tmp;
+        metas_cap = metas_cap ? metas_cap * 2 : LIST_ROWS * 4;
+    }
+    e->meta = nmetas++;
+    m = &metas[e->meta];
+    t = now_us();
+    ok = dir_fd >= 0 && fstatat(dir_fd, entry_name(idx), &st, 0) == 0;
+    span_end(SPAN_META, t);
+    if (ok) {
+        m->mode = st.st_mode;
+        m->size = st.st_size;
+        m->mtime = st.st_mtime;
+        m->dev = st.st_dev;
+        m->ino = st.st_ino;
+        m->ftype = FT_UNKNOWN;
+    } else {
+        m->mode = 0;
+        m->size = 0;
+        m->mtime = 0;
+        m->dev = 0;
+        m->ino = 0;
+        m->ftype = FT_UNREADABLE;
+    }
+    return m;
+}
+
+/* Compare names ignoring ASCII case */
+static int fold_cmp(const char *a, const char *b)
+{
+    int ca, cb;
+
+    do {
+        ca = FOLD((unsigned char)*a);
+        cb = FOLD((unsigned char)*b);
+        a++;
+        b++;
+    } while (ca == cb && ca != 0);
+    return ca - cb;
+}
+
+/* Like fold_cmp(), but runs of digits compare by value: file2 < file10 */
+static int natural_cmp(const char *a, const char *b)
+{
+    size_t la, lb;
+    int r;
+    int ca, cb;
+
+    while (*a && *b) {
+        if (IS_DIGIT(*a) && IS_DIGIT(*b)) {
+            while (*a == '0') a++;
+            while (*b == '0') b++;
+            for (la = 0; IS_DIGIT(a[la]); la++) ;
+            for (lb = 0; IS_DIGIT(b[lb]); lb++) ;
+            if (la != lb) return la < lb ? -1 : 1;
+            r = memcmp(a, b, la);
+            if (r != 0) return r;
+            a += la;
+            b += lb;
+            continue;
+        }
+        ca = FOLD((unsigned char)*a);
+        cb = FOLD((unsigned char)*b);
+        if (ca != cb) return ca - cb;
+        a++;
+        b++;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+/* Eight case-folded bytes of s from offset from, big-endian, zero-padded */
+static unsigned long long fold_prefix(const char *s, size_t len, size_t from)
+{
+    unsigned long long k = 0;
+    size_t i;
+
+    for (i = from; i < from + 8; i++) {
+        k = (k << 8) | (i < len ? (unsigned char)FOLD((unsigned char)s[i]) : 0);
+    }
+    return k;
+}
+
+/*
+ * Key prefix for natural order: the folded bytes up to the first digit,
+ * which itself becomes '0'. Names that agree up to a digit run tie and
+ * are settled by natural_cmp().
+ */
+static unsigned long long natural_prefix(const char *s, size_t len)
+{
+    unsigned long long k = 0;
+    size_t i;
+    int stop = 0;
+
+    for (i = 0; i < 8; i++) {
+        k <<= 8;
+        if (stop || i >= len) continue;
+        if (IS_DIGIT(s[i])) {
+            k |= '0';
+            stop = 1;
+        } else {
+            k |= (unsigned char)FOLD((unsigned char)s[i]);
+        }
+    }
+    return k;
+}
+
+/* Extension of an entry's name, "" if it has none; dotfiles have none */
+static const char *name_ext(int idx)
+{
+    const char *s = entry_name(idx);
+    const char *dot = strrchr(s, '.');
+
+    return dot != NULL && dot != s ? dot + 1 : "";
+}
+
+/* The ".." entry stays on top whatever the order */
+static int is_dotdot(int idx)
+{
+    return entries[idx].name_len == 2 && strcmp(entry_name(idx), "..") == 0;
+}
+
+/*
+ * Precompute the sort key of an entry: the top bit puts directories
+ * first, the rest is a prefix of the current order. Size and mtime
+ * orders stat the entry here.
+ */
+static unsigned long long sort_key(int idx)
+{
+    const char *s = entry_name(idx);
+    size_t len = entries[idx].name_len;
+    int is_dir = entries[idx].flags & E_DIR;
+    unsigned long long k;
+    Meta *m;
+    const char *ext;
+
+    if (is_dotdot(idx)) return 0;
+
+    if (sort_mode == SORT_NATURAL) {
+        k = natural_prefix(s, len) >> 1;
+    } else if (sort_mode == SORT_SIZE && !is_dir) {
+        m = entry_meta(idx);
+        k = m != NULL && m->size > 0 ? (unsigned long long)m->size : 0;
+    } else if (sort_mode == SORT_MTIME) {
+        m = entry_meta(idx);
+        /* bias so that times before 1970 still sort first */
+        k = (m != NULL ? (unsigned long long)(long long)m->mtime : 0) +
+            (1ULL << 62);
+    } else if (sort_mode == SORT_TYPE && !is_dir) {
+        ext = name_ext(idx);
+        k = fold_prefix(ext, strlen(ext), 0) >> 1;
+    } else {
+        k = fold_prefix(s, len, 0) >> 1;
+    }
+    k &= SORT_KEY_MASK;
+    if (sort_reverse) k = ~k & SORT_KEY_MASK;
+    return is_dir ? k : k | ~SORT_KEY_MASK;
+}
+
+/* The full order between two entries, for keys that tie */
+static int sort_cmp_entries(int a, int b)
+{
+    Meta *ma, *mb;
+    int da, db;
+    int r = 0;
+
+    if (a == b) return 0;
+    if (is_dotdot(a)) return -1;
+    if (is_dotdot(b)) return 1;
+    da = entries[a].flags & E_DIR;
+    db = entries[b].flags & E_DIR;
+    if (da != db) return da ? -1 : 1;
+
+    if (sort_mode == SORT_NATURAL) {
+        r = natural_cmp(entry_name(a), entry_name(b));
+    } else if ((sort_mode == SORT_SIZE && !da) || sort_mode == SORT_MTIME) {
+        ma = entry_meta(a);
+        mb = entry_meta(b);
+        if (ma != NULL && mb != NULL) {
+            if (sort_mode == SORT_SIZE) {
+                r = ma->size < mb->size ? -1 : ma->size > mb->size;
+            } else {
+                r = ma->mtime < mb->mtime ? -1 : ma->mtime > mb->mtime;
+            }
+        }
+    } else if (sort_mode == SORT_TYPE && !da) {
+        r = fold_cmp(name_ext(a), name_ext(b));
+    }
+    if (r == 0) r = fold_cmp(entry_name(a), entry_name(b));
+    if (r == 0) r = strcmp(entry_name(a), entry_name(b));
+    return sort_reverse ? -r : r;
+}
+
+static int sort_cmp(const void *a, const void *b)
+{
+    const SortKey *ka = (const SortKey*)a;
+    const SortKey *kb = (const SortKey*)b;
+
+    if (ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+    return sort_cmp_entries(ka->idx, kb->idx);
+}
+
+/*
+ * LSD radix sort on the 64-bit keys, a byte per pass, through sort_tmp.
+ * All eight histograms come from one read of the keys, and passes on a
+ * byte that is the same everywhere are skipped.
+ */
+static void radix_sort(SortKey *a, int n)
+{
+    static int count[8][256];
+    SortKey *src = a, *dst = sort_tmp, *t;
+    unsigned long long k;
+    int pass, i, b, sum, c;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+        k = a[i].key;
+        for (pass = 0; pass < 8; pass++) {
+            count[pass][(k >> (pass * 8)) & 0xff]++;
+        }
+    }
+
+    for (pass = 0; pass < 8; pass++) {
+        if (count[pass][(src[0].key >> (pass * 8)) & 0xff] == n) continue;
+        for (b = 0, sum = 0; b < 256; b++) {
+            c = count[pass][b];
+            count[pass][b] = sum;
+            sum += c;
+        }
+        for (i = 0; i < n; i++) {
+            dst[count[pass][(src[i].key >> (pass * 8)) & 0xff]++] = src[i];
+        }
+        t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != a) memcpy(a, src, sizeof(SortKey) * n);
+}
+
+/*
+ * Order a run of rows whose keys tie. In name order a big run is
+ * usually a shared prefix (file_000001, file_000002, ...), so the next
+ * eight bytes become the key and it is radix sorted again; anything
+ * else goes to the comparison sort. depth is the name offset the new
+ * keys start at; the first level key ends 7 bits into byte 7.
+ */
+static void sort_run(SortKey *a, int n, size_t depth)
+{
+    int i, j;
+
+    if (sort_mode != SORT_NAME || n < SORT_RADIX_MIN || depth > 255) {
+        qsort(a, n, sizeof(SortKey), sort_cmp);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        a[i].key = fold_prefix(entry_name(a[i].idx),
+                               entries[a[i].idx].name_len, depth);
+        if (sort_reverse) a[i].key = ~a[i].key;
+    }
+    radix_sort(a, n);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && a[j].key == a[i].key; j++) ;
+        if (j - i > 1) sort_run(a + i, j - i, depth + 8);
+    }
+}
+
+/* Sort n rows: radix on the keys, then settle ties */
+static void sort_keys(SortKey *a, int n)
+{
+    unsigned long long key;
+    int i, j, k;
+
+    if (n < SORT_RADIX_MIN) {
+        qsort(a, n, sizeof(SortKey), sort_cmp);
+        return;
+    }
+    radix_sort(a, n);
+    for (i = 0; i < n; i = j) {
+        key = a[i].key;
+        for (j = i + 1; j < n && a[j].key == key; j++) ;
+        if (j - i > 1) {
+            sort_run(a + i, j - i, 7);
+            /* sort_run() may have replaced the keys of the run */
+            for (k = i; k < j; k++) a[k].key = key;
+        }
+    }
+}
+
+/* Room for n more rows in order[], the scratch array and filt[] */
+static int view_reserve(int n)
+{
+    SortKey *tmp;
+    int cap;
+
+    if (norder + n <= order_cap) return 0;
+    cap = order_cap ? order_cap : SCAN_BATCH;
+    while (norder + n > cap) cap *= 2;
+    tmp = (SortKey*)realloc(order, sizeof(SortKey) * cap);
+    if (!tmp) return -1;
+    order = tmp;
+    tmp = (SortKey*)realloc(sort_tmp, sizeof(SortKey) * cap);
+    if (!tmp) return -1;
+    sort_tmp = tmp;
+    tmp = (SortKey*)realloc(filt, sizeof(SortKey) * cap);
+    if (!tmp) return -1;
+    filt = tmp;
+    order_cap = cap;
+    if (filter_len == 0) view = order;
+    else view = filt;
+    return 0;
+}
+
+/* Forget the rows; the listing is about to be replaced */
+static void view_clear(void)
+{
+    norder = 0;
+    nsorted = 0;
+    view_ents = 0;
+    ntombs = 0;
+    nview = 0;
+    folded_len = 0;
+    selected = -1;
+}
+
+/* Add rows for entries that joined the listing since the last call */
+static void view_append(void)
+{
+    if (view_reserve(nentries - view_ents) < 0) return;
+    for (; view_ents < nentries; view_ents++) {
+        if (entries[view_ents].flags & (E_GONE | E_DEAD)) {
+            entries[view_ents].flags = (entries[view_ents].flags & ~E_GONE) |
+                                       E_DEAD;
+            ntombs++;
+            continue;
+        }
+        entries[view_ents].flags &= ~(E_STALE | E_NEW);
+        order[norder].key = sort_key(view_ents);
+        order[norder].idx = view_ents;
+        norder++;
+    }
+}
+
+/*
+ * Sort the unsorted tail of order[] and merge it into the sorted part,
+ * from the back so rows ahead of the first insertion never move.
+ * Returns the first row that changed.
+ */
+static int view_merge(void)
+{
+    int m = norder - nsorted;
+    int i, j, k;
+    long long t;
+
+    if (m == 0) return norder;
+    t = now_us();
+    sort_keys(order + nsorted, m);
+    if (nsorted == 0) {
+        nsorted = norder;
+        span_end(SPAN_SORT, t);
+        return 0;
+    }
+
+    memcpy(sort_tmp, order + nsorted, sizeof(SortKey) * m);
+    i = nsorted - 1;
+    j = m - 1;
+    k = norder - 1;
+    while (j >= 0) {
+        if (i >= 0 && sort_cmp(&order[i], &sort_tmp[j]) > 0) {
+            order[k--] = order[i--];
+        } else {
+            order[k--] = sort_tmp[j--];
+        }
+    }
+    nsorted = norder;
+    span_end(SPAN_SORT, t);
+    return k + 1;
+}
+
+/*
+ * Derive the visible rows from order[] after it changed from row first
+ * on. Unfiltered, the view is order[] itself. Filtered, rows from
+ * order[from] on are matched again and appended to what filt[] holds
+ * for the rows before; from is 0 unless order[] only grew at the end.
+ * Returns the first visible row that changed.
+ */
+static int view_show(int first, int from)
+{
+    int old = nview;
+
+    if (filter_len == 0) {
+        view = order;
+        nview = norder;
+        return first;
+    }
+    view = filt;
+    if (from == 0) {
+        filter_all();
+        return 0;
+    }
+    filter_rows(order + from, norder - from);
+    return old;
+}
+
+/*
+ * Rows from first on were rearranged, the view having had old rows.
+ * The selection stays on entry sel, at the same height on screen; if
+ * that entry is gone the selection keeps its row.
+ */
+static void view_changed(int first, int old, int sel)
+{
+    int r;
+
+    if (selected >= 0 && (selected >= first || selected >= nview)) {
+        for (r = first; r < nview && view[r].idx != sel; r++) ;
+        if (r == nview) r = selected < nview ? selected : nview - 1;
+        scroll_to(scroll_top + r - selected);
+        selected = r;
+        damage_rect(0, LIST_Y + LIST_H, WINDOW_W, WINDOW_H - LIST_Y - LIST_H);
+    } else {
+        scroll_to(scroll_top);
+    }
+    damage_rows(first, old > nview ? old : nview);
+    /* the scrollbar thumb follows the length of the list */
+    damage_rect(LIST_X + LIST_W - SCROLLBAR_W, LIST_Y, SCROLLBAR_W, LIST_H);
+}
+
+/*
+ * Bring the view up to date with new entries. While a scan is still
+ * streaming in they wait unsorted at the bottom and are merged once they
+ * are a fair share of the list, so a big directory costs a few dozen
+ * merges rather than one per batch.
+ */
+static void view_sync(void)
+{
+    int old = nview;
+    int sel = selected >= 0 ? view[selected].idx : -1;
+    int grown = norder;
+    int first;
+
+    view_append();
+    first = grown;
+    if (norder > nsorted && ((!scanning && !index_walking) ||
+                             norder - nsorted >= nsorted / SORT_MERGE_DIV)) {
+        first = view_merge();
+    }
+    first = view_show(first, first < grown ? 0 : grown);
+    if (first < nview || nview != old) view_changed(first, old, sel);
+}
+
+/* The order changed: sort every row again */
+static void view_resort(void)
+{
+    int old = nview;
+    int sel = selected >= 0 ? view[selected].idx : -1;
+    int i;
+
+    for (i = 0; i < norder; i++) {
+        order[i].key = sort_key(order[i].idx);
+    }
+    nsorted = 0;
+    view_merge();
+    view_show(0, 0);
+    view_changed(0, old, sel);
+    /* the status line names the order */
+    damage_rect(0, LIST_Y + LIST_H, WINDOW_W, WINDOW_H - LIST_Y - LIST_H);
+}
+
+/*
+ * Drop the tombstones of deleted entries once they are half the listing,
+ * and rebuild the name index and the view over the survivors.
+ */
+static void listing_compact(void)
+{
+    int sel = selected >= 0 ? view[selected].idx : -1;
+    int old = nview;
+    int i, j;
+
+    for (i = 0, j = 0; i < nentries; i++) {
+        if (entries[i].flags & E_DEAD) continue;
+        if (i == sel) sel = j;
+        entries[j++] = entries[i];
+    }
+    nentries = j;
+    name_hash_n = 0;
+    name_index_sync();
+
+    norder = 0;
+    nsorted = 0;
+    view_ents = 0;
+    ntombs = 0;
+    view_append();
+    view_merge();
+    view_show(0, 0);
+    view_changed(0, old, sel);
+}
+
+/*
+ * Bring folded[] up to date with the name arena: the same bytes at the
+ * same offsets, case-folded, with FOLD_PAD zero bytes after the end so
+ * the match kernel may read a whole vector past any name.
+ */
+static int fold_sync(void)
+{
+    char *tmp;
+    size_t cap;
+
+    if (names_len + FOLD_PAD > folded_cap) {
+        cap = folded_cap ? folded_cap : SCAN_BATCH_NAMES;
+        while (names_len + FOLD_PAD > cap) cap *= 2;
+        tmp = (char*)realloc(folded, cap);
+        if (!tmp) return -1;
+        folded = tmp;
+        folded_cap = cap;
+    }
+    for (; folded_len < names_len; folded_len++) {
+        folded[folded_len] = FOLD((unsigned char)names[folded_len]);
+    }
+    memset(folded + names_len, 0, FOLD_PAD);
+    return 0;
+}
+
+/*
+ * Offset of the first occurrence of q in h[0, n), or -1. With SSE2,
+ * sixteen starting positions are tested at once on the first and the
+ * last byte of q and only those passing both are compared in full.
+ * h must be readable for FOLD_PAD bytes past n.
+ */
+static long find_folded(const char *h, size_t n, const char *q, size_t qlen)
+{
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(q[0]);
+    __m128i last = _mm_set1_epi8(q[qlen - 1]);
+    __m128i a, b;
+    unsigned int mask;
+    size_t i, pos;
+
+    for (i = 0; i + qlen <= n; i += 16) {
+        a = _mm_loadu_si128((const __m128i*)(h + i));
+        b = _mm_loadu_si128((const __m128i*)(h + i + qlen - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                               _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            pos = i + __builtin_ctz(mask);
+            if (pos + qlen > n) return -1;
+            if (memcmp(h + pos, q, qlen) == 0) return (long)pos;
+            mask &= mask - 1;
+        }
+    }
+    return -1;
+#else
+    const char *p = h;
+    const char *end = h + n;
+
+    while (p + qlen <= end &&
+           (p = (const char*)memchr(p, q[0], end - p - qlen + 1)) != NULL) {
+        if (memcmp(p, q, qlen) == 0) return (long)(p - h);
+        p++;
+    }
+    return -1;
+#endif
+}
+
+/* Does entry idx match the filter? */
+static int filter_match(int idx)
+{
+    const char *s = folded + entries[idx].name_off;
+    const char *end = s + entries[idx].name_len;
+    int i;
+
+    if (!filter_fuzzy) {
+        return find_folded(s, entries[idx].name_len, filter, filter_len) >= 0;
+    }
+    /* subsequence: each query byte somewhere after the previous one */
+    for (i = 0; i < filter_len; i++) {
+        s = (const char*)memchr(s, filter[i], end - s);
+        if (s == NULL) return 0;
+        s++;
+    }
+    return 1;
+}
+
+/* Append the matching rows of a[0, n) to the view */
+static void filter_rows(const SortKey *a, int n)
+{
+    int i;
+
+    if (fold_sync() < 0) return;
+    for (i = 0; i < n; i++) {
+        if (filter_match(a[i].idx)) {
+            filt[nview++] = a[i];
+        }
+    }
+}
+
+/*
+ * Match the filter against the whole listing. A substring search runs
+ * over the folded arena in one sweep, not name by name, and marks the
+ * entries it lands in; the view then takes the marked rows in order.
+ */
+static void filter_all(void)
+{
+    unsigned char *tmp;
+    size_t pos;
+    long off;
+    int idx;
+    int i;
+
+    nview = 0;
+    if (filter_fuzzy || fold_sync() < 0) {
+        filter_rows(order, norder);
+        return;
+    }
+    if (nentries > marks_cap) {
+        tmp = (unsigned char*)realloc(marks, nentries);
+        if (!tmp) return;
+        marks = tmp;
+        marks_cap = nentries;
+    }
+    memset(marks, 0, nentries);
+
+    /* name offsets grow with the entry index, so walk both together */
+    idx = 0;
+    pos = 0;
+    while (nentries > 0 &&
+           (off = find_folded(folded + pos, names_len - pos,
+                              filter, filter_len)) >= 0) {
+        pos += off;
+        while (idx + 1 < nentries && entries[idx + 1].name_off <= pos) idx++;
+        if (pos < entries[idx].name_off ||
+            pos >= entries[idx].name_off + entries[idx].name_len) {
+            /* in a name that was compacted away */
+            pos++;
+            continue;
+        }
+        marks[idx] = 1;
+        pos = entries[idx].name_off + entries[idx].name_len + 1;
+    }
+
+    for (i = 0; i < norder; i++) {
+        if (marks[order[i].idx]) {
+            filt[nview++] = order[i];
+        }
+    }
+}
+
+/*
+ * The filter text or mode changed. A query that only grew can only
+ * lose rows, so it is matched against the current view alone, unless
+ * that is still most of the listing and the sweep over the arena is
+ * cheaper; anything else starts from the whole listing. The selection
+ * stays on its entry while that still matches and goes to the first
+ * row otherwise.
+ */
+static void filter_update(int narrowed)
+{
+    int old = nview;
+    int sel = selected >= 0 ? view[selected].idx : -1;
+    long long t = now_us();
+    int n;
+    int r;
+
+    if (filter_len == 0) {
+        view_show(0, 0);
+    } else if (narrowed && view == filt &&
+               (filter_fuzzy || nview < norder / 4)) {
+        n = nview;
+        nview = 0;
+        filter_rows(filt, n);
+    } else {
+        view_show(0, 0);
+    }
+
+    for (r = 0; r < nview && view[r].idx != sel; r++) ;
+    if (r == nview && selected >= 0) {
+        selected = -1;
+        scroll_to(0);
+    }
+    view_changed(0, old, sel);
+    if (selected < 0) select_index(0);
+    damage_rect(0, LIST_Y + LIST_H, WINDOW_W, WINDOW_H - LIST_Y - LIST_H);
+    span_end(SPAN_FILTER, t);
+}
+
+/* FNV-1a over a name */
+static unsigned int name_hash_of(const char *name, size_t len)
+{
+    unsigned int h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Put entry idx into name_hash; the table is kept at most half full */
+static void name_index_add(int idx)
+{
+    unsigned int h;
+    int *tmp;
+    int cap;
+    int i;
+
+    if ((name_hash_n + 1) * 2 > name_hash_cap) {
+        cap = name_hash_cap ? name_hash_cap : 1024;
+        while ((name_hash_n + 1) * 2 > cap) cap *= 2;
+        tmp = (int*)realloc(name_hash, sizeof(int) * cap);
+        if (!tmp) return;
+        name_hash = tmp;
+        name_hash_cap = cap;
+        /* rehash what is indexed so far */
+        i = name_hash_n;
+        name_hash_n = 0;
+        memset(name_hash, 0xff, sizeof(int) * cap);
+        while (name_hash_n < i) name_index_add(name_hash_n);
+    }
+
+    h = name_hash_of(entry_name(idx), entries[idx].name_len);
+    while (name_hash[h & (name_hash_cap - 1)] >= 0) h++;
+    name_hash[h & (name_hash_cap - 1)] = idx;
+    name_hash_n++;
+}
+
+/* Index entries appended since the last call */
+static void name_index_sync(void)
+{
+    if (name_hash_n == 0 && name_hash_cap > 0) {
+        memset(name_hash, 0xff, sizeof(int) * name_hash_cap);
+    }
+    while (name_hash_n < nentries) name_index_add(name_hash_n);
+}
+
+/* Index of the entry called name, or -1 */
+static int name_lookup(const char *name, size_t len)
+{
+    unsigned int h;
+    int idx;
+
+    if (name_hash_cap == 0) return -1;
+    h = name_hash_of(name, len);
+    while ((idx = name_hash[h & (name_hash_cap - 1)]) >= 0) {
+        if (entries[idx].name_len == len &&
+            memcmp(entry_name(idx), name, len) == 0) {
+            return idx;
+        }
+        h++;
+    }
+    return -1;
+}
+
+#ifdef HAVE_INOTIFY
+static void watch_start(void)
+{
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) perror("inotify_init1");
+}
+
+/*
+ * Move the watch to the directory open as fd, dropping any events of
+ * the old one. inotify wants a path; the one in /proc leads to the fd.
+ */
+static void watch_dir(int fd)
+{
+    char buf[4096];
+    char path[32];
+
+    if (watch_fd < 0) return;
+    if (watch_wd >= 0) inotify_rm_watch(watch_fd, watch_wd);
+    while (read(watch_fd, buf, sizeof(buf)) > 0) {
+        /* stale events */
+    }
+    watch_armed = 0;
+    sprintf(path, "/proc/self/fd/%d", fd);
+    watch_wd = inotify_add_watch(watch_fd, path,
+                                 IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                 IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+}
+
+/*
+ * Called when watch_fd is readable. The first event of a burst starts
+ * the timer; returns the milliseconds left before watch_apply() is due,
+ * so the main loop can stop polling the fd meanwhile.
+ */
+static int watch_timeout(const struct timespec *now)
+{
+    long ms;
+
+    if (!watch_armed) {
+        watch_armed = 1;
+        watch_due = *now;
+        watch_due.tv_nsec += WATCH_COALESCE_MS * 1000000L;
+        if (watch_due.tv_nsec >= 1000000000L) {
+            watch_due.tv_sec++;
+            watch_due.tv_nsec -= 1000000000L;
+        }
+    }
+    ms = elapsed_ms(now, &watch_due);
+    return ms > 0 ? (int)ms : 0;
+}
+
+/*
+ * Apply a burst of directory events to the listing. Creations append,
+ * deletions become tombstones, attribute changes forget the cached
+ * metadata. Then one pass over order[] drops deleted rows and lifts
+ * out rows whose sort key moved, and those join the new entries in a
+ * single merge. The selection stays on its entry.
+ */
+static void watch_apply(void)
+{
+    char buf[65536];
+    struct inotify_event *ev;
+    struct stat st;
+    ssize_t len;
+    char *p;
+    size_t nlen;
+    time_t stamp = time(NULL);
+    Entry *e;
+    unsigned long long key;
+    int idx;
+    int flags;
+    int changed = 0;
+    int nnew = 0;
+    int old = nview;
+    int sel = selected >= 0 ? view[selected].idx : -1;
+    int first, mfirst;
+    int r, w, sorted;
+
+    watch_armed = 0;
+    if (scanning || dir_fd < 0) return;
+    if (goto_mode) {
+        /* not our listing on screen: read it again when goto mode ends */
+        while (read(watch_fd, buf, sizeof(buf)) > 0) {
+            /* drain */
+        }
+        dir_partial = 1;
+        index_stale = 1;
+        return;
+    }
+    name_index_sync();
+
+    while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len;
+             p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                /* lost track: fall back to a fresh scan */
+                read_dir();
+                reset_view();
+                return;
+            }
+            if (ev->wd != watch_wd || ev->len == 0) continue;
+            nlen = strlen(ev->name);
+            idx = name_lookup(ev->name, nlen);
+
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (idx >= 0 && !(entries[idx].flags & (E_GONE | E_DEAD))) {
+                    entries[idx].flags |= E_GONE;
+                    changed = 1;
+                }
+            } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                flags = 0;
+                if ((ev->mask & IN_ISDIR) ||
+                    (fstatat(dir_fd, ev->name, &st, 0) == 0 &&
+                     S_ISDIR(st.st_mode))) {
+                    flags = E_DIR;
+                }
+                if (idx < 0) {
+                    if (listing_add(ev->name, nlen, flags) == 0) {
+                        name_index_add(nentries - 1);
+                    }
+                } else if (entries[idx].flags & E_DEAD) {
+                    /* a tombstone comes back to life */
+                    entries[idx].flags = flags | E_NEW;
+                    entries[idx].meta = -1;
+                    ntombs--;
+                    nnew++;
+                } else {
+                    /* replaced, or deleted and recreated in this burst */
+                    entries[idx].flags = flags | E_STALE;
+                    entries[idx].meta = -1;
+                }
+                changed = 1;
+            } else if ((ev->mask & IN_ATTRIB) && idx >= 0 &&
+                       !(entries[idx].flags & (E_GONE | E_DEAD))) {
+                entries[idx].flags |= E_STALE;
+                entries[idx].meta = -1;
+                changed = 1;
+            }
+        }
+    }
+
+    if (changed) {
+        /* one pass: drop deleted rows, lift out rows that must move */
+        first = norder;
+        sorted = nsorted;
+        for (r = 0, w = 0; r < norder; r++) {
+            e = &entries[order[r].idx];
+            if (e->flags & E_GONE) {
+                e->flags = (e->flags & ~E_GONE) | E_DEAD;
+                ntombs++;
+            } else if (e->flags & E_STALE) {
+                e->flags &= ~E_STALE;
+                key = sort_key(order[r].idx);
+                if (key == order[r].key) {
+                    /* filtered, the whole view is redrawn anyway */
+                    if (filter_len == 0) damage_rows(w, w + 1);
+                    order[w++] = order[r];
+                    continue;
+                }
+                e->flags |= E_NEW;
+                nnew++;
+            } else {
+                order[w++] = order[r];
+                continue;
+            }
+            /* row r left the view */
+            if (r < first) first = w;
+            if (r < nsorted) sorted--;
+        }
+        norder = w;
+        nsorted = sorted;
+
+        /* re-placed and revived entries, then the brand new ones */
+        for (idx = 0; nnew > 0 && idx < view_ents; idx++) {
+            e = &entries[idx];
+            if (!(e->flags & E_NEW)) continue;
+            e->flags &= ~E_NEW;
+            if (view_reserve(1) == 0) {
+                order[norder].key = sort_key(idx);
+                order[norder].idx = idx;
+                norder++;
+            }
+            nnew--;
+        }
+        view_append();
+        mfirst = view_merge();
+        if (mfirst < first) first = mfirst;
+        first = view_show(first, 0);
+        view_changed(first, old, sel);
+
+        if (ntombs > SCAN_BATCH && ntombs * 2 > nentries) {
+            listing_compact();
+        }
+    }
+
+    /* the listing is now current as of stamp */
+    fstat(dir_fd, &cur_st);
+    cur_stamp = stamp;
+}
+#else
+/* No change notification on this system: listings refresh on reentry */
+static void watch_start(void)
+{
+}
+
+static void watch_dir(int fd)
+{
+    (void)fd;
+}
+
+static int watch_timeout(const struct timespec *now)
+{
+    (void)now;
+    return -1;
+}
+
+static void watch_apply(void)
+{
+}
+#endif
+
+/*
+ * Speculative prefetch. Once the selection has rested on a directory
+ * for PREFETCH_DELAY_MS and nothing in the foreground is reading, that
+ * directory and the nearest ones around it are read into the listing
+ * cache by a single idle-priority thread, so opening them is a cache
+ * hit. Prefetched listings that have not been visited yet may use
+ * only 1/PREFETCH_SHARE of the cache; past that the oldest of them go
+ * first, and a single directory bigger than that is not kept at all.
+ */
+
+/* Thread for prefetching, started on first use */
+static int prefetch_start(void)
+{
+    if (prefetch_running) return 0;
+    if (stat("/", &root_st) != 0) return -1;
+    if (pthread_create(&prefetch_thread, NULL, prefetch_main, NULL) != 0) {
+        return -1;
+    }
+    prefetch_running = 1;
+    return 0;
+}
+
+static void *prefetch_main(void *arg)
+{
+    PrefetchReq req;
+    Listing *l;
+    int i;
+#ifdef SCHED_IDLE
+    struct sched_param sp;
+
+    /* only run when nothing else wants the CPU */
+    sp.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+#endif
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (prefetch_req.fd < 0) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        }
+        req = prefetch_req;
+        prefetch_req.fd = -1;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        for (i = 0; i < req.n; i++) {
+            if (__atomic_load_n(&prefetch_gen, __ATOMIC_ACQUIRE) != req.gen) {
+                break;
+            }
+            l = prefetch_read(req.fd, req.names[i], req.gen);
+            if (l == NULL) continue;
+            pthread_mutex_lock(&prefetch_lock);
+            l->next = prefetch_ready;
+            prefetch_ready = l;
+            pthread_mutex_unlock(&prefetch_lock);
+            if (write(wake_pipe[1], "p", 1) < 0 && errno != EAGAIN) {
+                perror("write");
+            }
+        }
+        close(req.fd);
+    }
+    return NULL;
+}
+
+/* Append an entry to a listing being built off the UI thread */
+static int prefetch_add(Listing *l, const char *name, size_t len, int flags)
+{
+    Entry *etmp;
+    char *ntmp;
+    size_t ncap;
+    int ecap;
+
+    if (l->nentries == l->entries_cap) {
+        ecap = l->entries_cap ? l->entries_cap * 2 : 64;
+        etmp = (Entry*)realloc(l->entries, sizeof(Entry) * ecap);
+        if (etmp == NULL) return -1;
+        l->entries = etmp;
+        l->entries_cap = ecap;
+    }
+    if (l->names_len + len + 1 > l->names_cap) {
+        ncap = l->names_cap ? l->names_cap * 2 : 4096;
+        while (l->names_len + len + 1 > ncap) ncap *= 2;
+        ntmp = (char*)realloc(l->names, ncap);
+        if (ntmp == NULL) return -1;
+        l->names = ntmp;
+        l->names_cap = ncap;
+    }
+    l->entries[l->nentries].name_off = l->names_len;
+    l->entries[l->nentries].name_len = len;
+    l->entries[l->nentries].flags = flags;
+    l->entries[l->nentries].meta = -1;
+    l->nentries++;
+    memcpy(l->names + l->names_len, name, len + 1);
+    l->names_len += len + 1;
+    return 0;
+}
+
+static void prefetch_free(Listing *l)
+{
+    free(l->entries);
+    free(l->names);
+    free(l->metas);
+    free(l);
+}
+
+/*
+ * Read directory name under dfd into a new listing, laid out the way
+ * read_dir() would have left it. NULL if it could not be read, was
+ * too big to keep, or the request was superseded meanwhile.
+ */
+static Listing *prefetch_read(int dfd, const char *name, unsigned long gen)
+{
+    Listing *l;
+    struct dirent *de;
+    struct stat st;
+    size_t cap = cache_budget / PREFETCH_SHARE;
+    int fd;
+    int ok = 1;
+
+    fd = openat(dfd, name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return NULL;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (fstat(fd, &st) != 0 || dir_open(&prefetch_reader, fd) < 0) {
+        close(fd);
+        return NULL;
+    }
+    l = (Listing*)calloc(1, sizeof(Listing));
+    if (l == NULL) {
+        dir_close(&prefetch_reader);
+        return NULL;
+    }
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+    l->mtime = st.st_mtime;
+    l->ctime = st.st_ctime;
+    l->stamp = time(NULL);
+    if (st.st_dev != root_st.st_dev || st.st_ino != root_st.st_ino) {
+        ok = prefetch_add(l, "..", 2, E_DIR) == 0;
+    }
+
+    while (ok && (de = dir_next(&prefetch_reader)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0) continue;
+        if (strcmp(de->d_name, "..") == 0) continue;
+        if (prefetch_add(l, de->d_name, strlen(de->d_name),
+                         classify_dir(fd, de) ? E_DIR : 0) < 0) {
+            ok = 0;
+        }
+        if (l->nentries % SCAN_BATCH == 0) {
+            if (__atomic_load_n(&prefetch_gen, __ATOMIC_ACQUIRE) != gen ||
+                listing_bytes(l) > cap) {
+                ok = 0;
+            }
+        }
+    }
+    dir_close(&prefetch_reader);
+    if (!ok || listing_bytes(l) > cap) {
+        prefetch_free(l);
+        return NULL;
+    }
+    return l;
+}
+
+/* Is directory entry idx already in the cache, as far as we can tell? */
+static int prefetch_cached(int idx)
+{
+    Listing *l;
+    Meta *m = entry_meta(idx);
+
+    if (m == NULL || !S_ISDIR(m->mode)) return 1;
+    for (l = cache_head; l != NULL; l = l->next) {
+        if (l->dev == m->dev && l->ino == m->ino) return l->mtime == m->mtime;
+    }
+    return 0;
+}
+
+/*
+ * Hand the prefetcher the selected directory and up to
+ * PREFETCH_SIBLINGS directories on either side of it, replacing
+ * whatever it had not started on yet.
+ */
+static void prefetch_request(void)
+{
+    int rows[PREFETCH_TARGETS];
+    int n = 0;
+    int i, k, r;
+    int fd;
+
+    if (prefetch_start() < 0) return;
+    if (entries[view[selected].idx].flags & E_DIR) rows[n++] = selected;
+    for (k = -1; k <= 1; k += 2) {
+        i = 0;
+        for (r = selected + k; r >= 0 && r < nview && i < PREFETCH_SIBLINGS;
+             r += k) {
+            if (entries[view[r].idx].flags & E_DIR) {
+                rows[n++] = r;
+                i++;
+            }
+        }
+    }
+    for (i = 0, k = 0; i < n; i++) {
+        if (!prefetch_cached(view[rows[i]].idx)) rows[k++] = rows[i];
+    }
+    if (k == 0) return;
+
+    fd = dup(dir_fd);
+    if (fd < 0) return;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    pthread_mutex_lock(&prefetch_lock);
+    if (prefetch_req.fd >= 0) close(prefetch_req.fd);
+    prefetch_req.fd = fd;
+    prefetch_req.gen = __atomic_load_n(&prefetch_gen, __ATOMIC_ACQUIRE);
+    prefetch_req.n = k;
+    for (i = 0; i < k; i++) {
+        strncpy(prefetch_req.names[i], entry_name(view[rows[i]].idx),
+                NAME_MAX);
+        prefetch_req.names[i][NAME_MAX] = '\0';
+    }
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+/*
+ * Called by the main loop: tracks where the selection rests and asks
+ * for a prefetch once it has rested long enough while the foreground
+ * is idle. Returns the milliseconds until that is due, or -1.
+ */
+static int prefetch_timeout(const struct timespec *now)
+{
+    long ms;
+    int idx;
+
+    if (cache_budget == 0 || goto_mode || dir_fd < 0 ||
+        selected < 0 || selected >= nview) {
+        return -1;
+    }
+    idx = view[selected].idx;
+    if (idx != prefetch_sel) {
+        prefetch_sel = idx;
+        prefetch_since = *now;
+        prefetch_sent = 0;
+    }
+    /* the end of a scan or walk wakes the loop, we look again then */
+    if (prefetch_sent || scanning || index_walking) return -1;
+    ms = elapsed_ms(&prefetch_since, now);
+    if (ms < PREFETCH_DELAY_MS) return PREFETCH_DELAY_MS - ms;
+    prefetch_sent = 1;
+    prefetch_request();
+    return -1;
+}
+
+/* Move finished prefetches into the cache */
+static void prefetch_collect(void)
+{
+    Listing *list, *l, *v, *prev;
+    size_t bytes;
+
+    pthread_mutex_lock(&prefetch_lock);
+    list = prefetch_ready;
+    prefetch_ready = NULL;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    while (list != NULL) {
+        l = list;
+        list = l->next;
+        for (v = cache_head; v != NULL; v = v->next) {
+            if (v->dev == l->dev && v->ino == l->ino) break;
+        }
+        bytes = listing_bytes(l);
+        if (v != NULL || (l->dev == cur_st.st_dev && l->ino == cur_st.st_ino)) {
+            prefetch_free(l);
+            continue;
+        }
+        /* room among the prefetched: drop the least recent of them */
+        v = cache_tail;
+        while (prefetch_bytes + bytes > cache_budget / PREFETCH_SHARE &&
+               v != NULL) {
+            prev = v->prev;
+            if (v->spec) {
+                cache_unlink(v);
+                prefetch_free(v);
+            }
+            v = prev;
+        }
+        l->spec = 1;
+        l->prev = NULL;
+        l->next = cache_head;
+        if (cache_head) cache_head->prev = l; else cache_tail = l;
+        cache_head = l;
+        cache_bytes += bytes;
+        prefetch_bytes += bytes;
+        cache_evict();
+    }
+}
+
+/*
+ * Preview pane. Once the selection has rested on a regular file for
+ * PREVIEW_DELAY_MS, the preview thread preads its first PREVIEW_BYTES
+ * and lays them out as text lines, or as a hex dump if they look
+ * binary. Layouts are kept by (dev, ino, mtime) in a small LRU, so
+ * coming back to a file shows it at once. There is a single request
+ * slot and each move of the selection invalidates it, so scrolling
+ * through a listing never queues reads for rows already left behind.
+ */
+
+/* Thread for previews, started on first use */
+static int preview_start(void)
+{
+    if (preview_running) return 0;
+    if (pthread_create(&preview_thread, NULL, preview_main, NULL) != 0) {
+        return -1;
+    }
+    preview_running = 1;
+    return 0;
+}
+
+static void *preview_main(void *arg)
+{
+    PreviewReq req;
+    Preview *p;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&preview_lock);
+        while (preview_req.fd < 0) {
+            pthread_cond_wait(&preview_cond, &preview_lock);
+        }
+        req = preview_req;
+        preview_req.fd = -1;
+        preview_req.name = NULL;
+        pthread_mutex_unlock(&preview_lock);
+
+        p = NULL;
+        if (__atomic_load_n(&preview_gen, __ATOMIC_ACQUIRE) == req.gen) {
+            p = preview_read(&req);
+        }
+        close(req.fd);
+        free(req.name);
+        if (p == NULL) continue;
+
+        pthread_mutex_lock(&preview_lock);
+        free(preview_ready);
+        preview_ready = p;
+        pthread_mutex_unlock(&preview_lock);
+        if (write(wake_pipe[1], "v", 1) < 0 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+    return NULL;
+}
+
+/* Read and lay out the head of the file req names */
+static Preview *preview_read(const PreviewReq *req)
+{
+    unsigned char buf[PREVIEW_BYTES];
+    struct stat st;
+    Preview *p;
+    ssize_t n;
+    int fd;
+
+    /* O_NONBLOCK: the entry may have become a fifo since it was stat'ed */
+    fd = openat(req->fd, req->name, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+    if (fd < 0) return NULL;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    n = pread(fd, buf, sizeof(buf), 0);
+    close(fd);
+    if (n < 0) return NULL;
+
+    p = (Preview*)malloc(sizeof(Preview));
+    if (p == NULL) return NULL;
+    p->dev = st.st_dev;
+    p->ino = st.st_ino;
+    p->mtime = st.st_mtime;
+    p->used = 0;
+    preview_layout(p, buf, n);
+    return p;
+}
+
+/*
+ * Text if there is no NUL and few control characters in the head.
+ * Tabs are expanded, other unprintable bytes, UTF-8 included, shown
+ * as dots, and lines cut at PREVIEW_COLS.
+ */
+static void preview_layout(Preview *p, const unsigned char *buf, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i, ctl = 0;
+    char *s;
+    int col = 0;
+    int j;
+
+    for (i = 0; i < n; i++) {
+        if (buf[i] == 0) break;
+        if (buf[i] < 0x20 && buf[i] != '\n' && buf[i] != '\t' &&
+            buf[i] != '\r' && buf[i] != '\f') {
+            ctl++;
+        }
+    }
+    p->hex = i < n || ctl * 10 > n;
+    p->nlines = 0;
+
+    if (p->hex) {
+        for (i = 0; i < n && p->nlines < PREVIEW_LINES; i += 8) {
+            s = p->lines[p->nlines++];
+            s += sprintf(s, "%06lx ", (unsigned long)i);
+            for (j = 0; j < 8; j++) {
+                if (i + j < n) {
+                    *s++ = hex[buf[i + j] >> 4];
+                    *s++ = hex[buf[i + j] & 15];
+                } else {
+                    *s++ = ' ';
+                    *s++ = ' ';
+                }
+                *s++ = ' ';
+            }
+            for (j = 0; j < 8 && i + j < n; j++) {
+                *s++ = buf[i + j] >= 0x20 && buf[i + j] < 0x7f ? buf[i + j]
+                                                                : '.';
+            }
+            *s = '\0';
+        }
+        return;
+    }
+
+    s = p->lines[0];
+    for (i = 0; i < n && p->nlines < PREVIEW_LINES; i++) {
+        if (buf[i] == '\n') {
+            s[col] = '\0';
+            if (++p->nlines < PREVIEW_LINES) s = p->lines[p->nlines];
+            col = 0;
+        } else if (buf[i] == '\r') {
+            /* dropped */
+        } else if (buf[i] == '\t') {
+            do {
+                if (col < PREVIEW_COLS) s[col++] = ' ';
+            } while (col % 8 != 0 && col < PREVIEW_COLS);
+        } else if (col < PREVIEW_COLS) {
+            s[col++] = buf[i] >= 0x20 && buf[i] < 0x7f ? buf[i] : '.';
+        }
+    }
+    if (p->nlines < PREVIEW_LINES && col > 0) {
+        s[col] = '\0';
+        p->nlines++;
+    }
+}
+
+/* The kept layout for this version of a file, or NULL */
+static Preview *preview_find(dev_t dev, ino_t ino, time_t mtime)
+{
+    int i;
+
+    for (i = 0; i < PREVIEW_CACHE; i++) {
+        if (preview_cache[i].used != 0 && preview_cache[i].ino == ino &&
+            preview_cache[i].dev == dev && preview_cache[i].mtime == mtime) {
+            preview_cache[i].used = ++preview_clock;
+            return &preview_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* Keep p in place of the least recently shown layout */
+static Preview *preview_store(const Preview *p)
+{
+    Preview *v = &preview_cache[0];
+    int i;
+
+    for (i = 0; i < PREVIEW_CACHE; i++) {
+        if (preview_cache[i].ino == p->ino && preview_cache[i].dev == p->dev) {
+            v = &preview_cache[i];      /* an older version of it */
+            break;
+        }
+        if (preview_cache[i].used < v->used) v = &preview_cache[i];
+    }
+    *v = *p;
+    v->used = ++preview_clock;
+    return v;
+}
+
+/*
+ * Called by the main loop: follows the selection, shows a kept layout
+ * straight away and asks for a new one once the selection has rested.
+ * Returns the milliseconds until that is due, or -1.
+ */
+static int preview_timeout(const struct timespec *now)
+{
+    PreviewReq req;
+    Meta *m;
+    long ms;
+    int idx;
+
+    if (!preview_on || dir_fd < 0 || selected < 0 || selected >= nview) {
+        return -1;
+    }
+    idx = view[selected].idx;
+    m = entry_meta(idx);
+    if (idx != preview_sel) {
+        preview_sel = idx;
+        preview_since = *now;
+        /* whatever was asked for before is of no use now */
+        __atomic_add_fetch(&preview_gen, 1, __ATOMIC_RELEASE);
+        preview_cur = NULL;
+        if (m != NULL && S_ISREG(m->mode)) {
+            preview_cur = preview_find(m->dev, m->ino, m->mtime);
+        }
+        preview_sent = preview_cur != NULL || m == NULL || !S_ISREG(m->mode);
+        damage_rect(PREVIEW_X, LIST_Y, PREVIEW_W, LIST_H);
+    }
+    if (preview_sent) return -1;
+    ms = elapsed_ms(&preview_since, now);
+    if (ms < PREVIEW_DELAY_MS) return PREVIEW_DELAY_MS - ms;
+    preview_sent = 1;
+
+    if (preview_start() < 0) return -1;
+    req.fd = dup(dir_fd);
+    req.name = strdup(entry_name(idx));
+    req.gen = __atomic_load_n(&preview_gen, __ATOMIC_ACQUIRE);
+    if (req.fd < 0 || req.name == NULL) {
+        if (req.fd >= 0) close(req.fd);
+        free(req.name);
+        return -1;
+    }
+    fcntl(req.fd, F_SETFD, FD_CLOEXEC);
+    pthread_mutex_lock(&preview_lock);
+    if (preview_req.fd >= 0) close(preview_req.fd);
+    free(preview_req.name);
+    preview_req = req;
+    pthread_cond_signal(&preview_cond);
+    pthread_mutex_unlock(&preview_lock);
+    return -1;
+}
+
+/* Keep a finished layout, and show it if it is still the selection's */
+static void preview_collect(void)
+{
+    Preview *p;
+    Meta *m;
+
+    pthread_mutex_lock(&preview_lock);
+    p = preview_ready;
+    preview_ready = NULL;
+    pthread_mutex_unlock(&preview_lock);
+    if (p == NULL) return;
+
+    m = preview_sel >= 0 ? entry_meta(preview_sel) : NULL;
+    if (m != NULL && m->dev == p->dev && m->ino == p->ino) {
+        preview_cur = preview_store(p);
+        damage_rect(PREVIEW_X, LIST_Y, PREVIEW_W, LIST_H);
+    } else {
+        preview_store(p);
+    }
+    free(p);
+}
+
+/* The selection's name, then its layout if there is one */
+static void draw_preview(void)
+{
+    const char *name;
+    int y = LIST_Y;
+    int i;
+
+    XDrawLine(dpy, backbuf, gc, PREVIEW_X - MARGIN / 2, LIST_Y,
+              PREVIEW_X - MARGIN / 2, LIST_Y + LIST_H);
+    if (selected < 0 || selected >= nview) return;
+    name = entry_name(view[selected].idx);
+    XDrawString(dpy, backbuf, gc, PREVIEW_X, y + fontinfo->ascent,
+                name, strlen(name));
+    XDrawLine(dpy, backbuf, gc, PREVIEW_X, y + LINE_HEIGHT - 2,
+              PREVIEW_X + PREVIEW_W, y + LINE_HEIGHT - 2);
+    if (preview_cur == NULL || preview_sel != view[selected].idx) return;
+    for (i = 0; i < preview_cur->nlines && i < LIST_ROWS - 1; i++) {
+        y += LINE_HEIGHT;
+        XDrawString(dpy, backbuf, gc, PREVIEW_X, y + fontinfo->ascent,
+                    preview_cur->lines[i], strlen(preview_cur->lines[i]));
+    }
+}
+
+/*
+ * Subtree index for goto mode. One task per directory on a pool of
+ * workers, each with its own deque: a worker pushes the subdirectories
+ * it finds and pops them back LIFO, idle workers steal the oldest tasks
+ * of the others. Directories are opened with openat() on their parent's
+ * fd, so no path is ever resolved from the root; the relative paths are
+ * only built for display.
+ */
+static IndexDir *index_dir_new(IndexDir *parent, const char *path,
+                               size_t len, size_t name_off)
+{
+    IndexDir *d = (IndexDir*)malloc(sizeof(IndexDir) + len + 1);
+
+    if (d == NULL) return NULL;
+    d->parent = parent;
+    d->fd = -1;
+    d->refs = 1;
+    d->gen = parent ? parent->gen : 0;
+    d->job = parent ? parent->job : NULL;
+    d->sniff = NULL;
+    d->del = parent ? parent->del : NULL;
+    d->path = (char*)(d + 1);
+    d->path_len = len;
+    d->name_off = name_off;
+    memcpy(d->path, path, len);
+    d->path[len] = '\0';
+    return d;
+}
+
+/* Drop a reference; the last one closes the fd its children opened from */
+static void index_release(IndexDir *d)
+{
+    if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (d->fd >= 0) close(d->fd);
+    free(d);
+}
+
+/*
+ * One unit of the walk is done: a directory listed, or a batch handed to
+ * the UI. Batches being filled count as pending too, so whoever
+ * finishes the last unit knows every path has been posted and
+ * announces the end of the walk.
+ */
+static void index_finish(void)
+{
+    ScanBatch *b;
+
+    if (__atomic_sub_fetch(&index_pending, 1, __ATOMIC_ACQ_REL) != 0) return;
+    b = scan_batch_get(__atomic_load_n(&index_gen, __ATOMIC_ACQUIRE));
+    if (b != NULL) {
+        b->done = 1;
+        index_post(b);
+    }
+}
+
+/*
+ * Queue a task on worker w's deque and wake an idle worker. On failure
+ * the caller still owns d and its accounting.
+ */
+static int index_push(int w, IndexDir *d)
+{
+    IndexDeque *q = &index_deques[w];
+    IndexDir **tmp;
+    int cap;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        if (q->head > 0) {
+            memmove(q->items, q->items + q->head,
+                    sizeof(IndexDir*) * (q->tail - q->head));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            cap = q->cap ? q->cap * 2 : 64;
+            tmp = (IndexDir**)realloc(q->items, sizeof(IndexDir*) * cap);
+            if (tmp == NULL) {
+                pthread_mutex_unlock(&q->lock);
+                return -1;
+            }
+            q->items = tmp;
+            q->cap = cap;
+        }
+    }
+    q->items[q->tail++] = d;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&index_lock);
+    index_queued++;
+    pthread_cond_signal(&index_cond);
+    pthread_mutex_unlock(&index_lock);
+    return 0;
+}
+
+/* Take a task: the newest of our own, else the oldest of someone else's */
+static IndexDir *index_take(int w)
+{
+    IndexDeque *q;
+    IndexDir *d = NULL;
+    int i;
+
+    q = &index_deques[w];
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) d = q->items[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+
+    for (i = 1; d == NULL && i < index_nthreads; i++) {
+        q = &index_deques[(w + i) % index_nthreads];
+        pthread_mutex_lock(&q->lock);
+        if (q->tail > q->head) d = q->items[q->head++];
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    if (d != NULL) {
+        pthread_mutex_lock(&index_lock);
+        index_queued--;
+        pthread_mutex_unlock(&index_lock);
+    }
+    return d;
+}
+
+/* Hand a batch of paths to the UI */
+static void index_post(ScanBatch *b)
+{
+    pthread_mutex_lock(&scan_lock);
+    b->next = NULL;
+    *index_ready_tail = b;
+    index_ready_tail = &b->next;
+    pthread_mutex_unlock(&scan_lock);
+    if (write(wake_pipe[1], "i", 1) < 0 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+/*
+ * List one directory: every entry goes out as a path relative to the
+ * root, and real subdirectories (not symlinks, so there are no loops)
+ * become tasks of their own.
+ */
+static void index_walk(int w, IndexDir *d, ScanBatch **bp)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    ScanBatch *b = *bp;
+    IndexDir *child;
+    Entry *e;
+    size_t nlen, len, name_off;
+    char *p;
+    int fd;
+    int walk;
+
+    if (d->gen != __atomic_load_n(&index_gen, __ATOMIC_ACQUIRE)) {
+        /* walk abandoned */
+        if (d->parent) index_release(d->parent);
+        index_release(d);
+        return;
+    }
+    if (d->parent != NULL) {
+        d->fd = openat(d->parent->fd, d->path + d->name_off,
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (d->fd >= 0) fcntl(d->fd, F_SETFD, FD_CLOEXEC);
+        index_release(d->parent);
+    }
+    fd = d->fd >= 0 ? dup(d->fd) : -1;
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0) close(fd);
+        index_release(d);
+        return;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (d->gen != __atomic_load_n(&index_gen, __ATOMIC_ACQUIRE)) break;
+        if (strcmp(de->d_name, ".") == 0) continue;
+        if (strcmp(de->d_name, "..") == 0) continue;
+
+        nlen = strlen(de->d_name);
+        name_off = d->path_len ? d->path_len + 1 : 0;
+        len = name_off + nlen;
+        if (len + 1 > SCAN_BATCH_NAMES) continue;   /* too deep to show */
+
+        if (b != NULL && (b->n == SCAN_BATCH || b->gen != d->gen ||
+                          b->names_len + len + 1 > SCAN_BATCH_NAMES)) {
+            index_post(b);
+            index_finish();
+            b = NULL;
+        }
+        if (b == NULL) {
+            b = scan_batch_get(d->gen);
+            if (b == NULL) break; /* OOM */
+            __atomic_add_fetch(&index_pending, 1, __ATOMIC_ACQ_REL);
+        }
+
+        e = &b->ents[b->n++];
+        p = b->names + b->names_len;
+        memcpy(p, d->path, d->path_len);
+        if (d->path_len) p[d->path_len] = '/';
+        memcpy(p + name_off, de->d_name, nlen + 1);
+        e->name_off = b->names_len;
+        e->name_len = len;
+        e->meta = -1;
+        b->names_len += len + 1;
+
+#ifdef DT_UNKNOWN
+        walk = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN)
+#endif
+            walk = fstatat(d->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                   S_ISDIR(st.st_mode);
+        e->flags = walk ? E_DIR | E_WALKED
+                        : classify_dir(d->fd, de) ? E_DIR : 0;
+
+        if (walk) {
+            child = index_dir_new(d, p, len, name_off);
+            if (child != NULL) {
+                __atomic_add_fetch(&d->refs, 1, __ATOMIC_ACQ_REL);
+                __atomic_add_fetch(&index_pending, 1, __ATOMIC_ACQ_REL);
+                if (index_push(w, child) < 0) {
+                    /* the walk just misses this subtree */
+                    index_release(d);
+                    index_release(child);
+                    index_finish();
+                }
+            }
+        }
+    }
+    closedir(dir);
+    index_release(d);
+    *bp = b;
+}
+
+/* Pool worker: take tasks until there are none, then sleep */
+static void *index_main(void *arg)
+{
+    int w = (int)(long)arg;
+    IndexDir *d;
+    ScanBatch *b = NULL;
+
+    while (1) {
+        d = index_take(w);
+        if (d == NULL) {
+            /* going idle: whatever we hold goes to the UI first */
+            if (b != NULL) {
+                index_post(b);
+                b = NULL;
+                index_finish();
+            }
+            pthread_mutex_lock(&index_lock);
+            while (index_queued == 0) {
+                pthread_cond_wait(&index_cond, &index_lock);
+            }
+            pthread_mutex_unlock(&index_lock);
+            continue;
+        }
+
+        if (d->sniff != NULL) {
+            sniff_run(d);
+        } else if (d->del != NULL) {
+            del_walk(w, d);
+        } else if (d->job != NULL) {
+            size_walk(w, d);
+        } else {
+            index_walk(w, d, &b);
+            index_finish();
+        }
+    }
+    return NULL;
+}
+
+/* Start the pool on first use, one worker per CPU up to INDEX_THREADS */
+static int index_start(void)
+{
+    pthread_t t;
+    long n;
+    int i;
+
+    if (index_nthreads > 0) return 0;
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > INDEX_THREADS) n = INDEX_THREADS;
+    for (i = 0; i < n; i++) {
+        pthread_mutex_init(&index_deques[i].lock, NULL);
+    }
+    index_nthreads = n;
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&t, NULL, index_main, (void*)(long)i) != 0) {
+            if (i == 0) {
+                fprintf(stderr, "Unable to start indexer threads.\n");
+                index_nthreads = 0;
+                return -1;
+            }
+            /* index_take() only steals from deques that have a worker */
+            index_nthreads = i;
+            break;
+        }
+        pthread_detach(t);
+    }
+    return 0;
+}
+
+/* Walk the subtree of the open directory into the (empty) listing */
+static void index_begin(void)
+{
+    IndexDir *d;
+    int fd;
+
+    if (index_start() < 0 || dir_fd < 0) return;
+    /* an open of its own, not sharing dir_fd's offset, as in read_dir() */
+    fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    d = index_dir_new(NULL, "", 0, 0);
+    if (d == NULL) {
+        close(fd);
+        return;
+    }
+    d->fd = fd;
+    d->gen = __atomic_add_fetch(&index_gen, 1, __ATOMIC_ACQ_REL);
+    index_dev = cur_st.st_dev;
+    index_ino = cur_st.st_ino;
+    index_stamp = time(NULL);
+    index_stale = 0;
+    index_walking = 1;
+    __atomic_add_fetch(&index_pending, 1, __ATOMIC_ACQ_REL);
+    if (index_push(0, d) < 0) {
+        index_release(d);
+        index_finish();
+    }
+}
+
+/*
+ * Can the kept index be shown again? It must be of this directory and
+ * complete, and neither the root nor any directory it walked may have
+ * changed since the walk started; a change in that same second counts.
+ * The directories are stat'ed through their relative paths.
+ */
+static int index_fresh(void)
+{
+    struct stat st;
+    int i;
+
+    if (index_stale || index_dev != cur_st.st_dev ||
+        index_ino != cur_st.st_ino || nentries == 0) return 0;
+    if (fstat(dir_fd, &st) != 0 || st.st_mtime >= index_stamp ||
+        st.st_ctime >= index_stamp) return 0;
+    for (i = 0; i < nentries; i++) {
+        if (!(entries[i].flags & E_WALKED)) continue;
+        if (fstatat(dir_fd, entry_name(i), &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISDIR(st.st_mode) || st.st_mtime >= index_stamp ||
+            st.st_ctime >= index_stamp) return 0;
+    }
+    return 1;
+}
+
+/* Append the paths the workers found; returns nonzero on any change */
+static int index_collect(void)
+{
+    ScanBatch *list, *b;
+    unsigned long gen;
+    int changed = 0;
+
+    pthread_mutex_lock(&scan_lock);
+    list = index_ready;
+    index_ready = NULL;
+    index_ready_tail = &index_ready;
+    pthread_mutex_unlock(&scan_lock);
+
+    gen = __atomic_load_n(&index_gen, __ATOMIC_ACQUIRE);
+    while (list != NULL) {
+        b = list;
+        list = b->next;
+        if (b->gen == gen && goto_mode) {
+            listing_take(b);
+            if (b->done) {
+                index_walking = 0;
+                damage_rect(0, LIST_Y + LIST_H, WINDOW_W,
+                            WINDOW_H - LIST_Y - LIST_H);
+            }
+            changed = 1;
+        }
+        scan_batch_put(b);
+    }
+    if (changed) view_sync();
+    return changed;
+}
+
+/*
+ * Goto mode: the list shows every path below the directory, from the
+ * kept index when it is still fresh, otherwise streamed in by a new
+ * walk. The directory's own listing is parked meanwhile; if its scan
+ * had not finished, or it changed, it is read again on the way out.
+ */
+static void goto_enter(void)
+{
+    int i;
+
+    if (goto_mode || dir_fd < 0) return;
+
+    if (scanning) {
+        pthread_mutex_lock(&scan_lock);
+        __atomic_add_fetch(&scan_gen, 1, __ATOMIC_RELEASE);
+        if (scan_req_fd >= 0) close(scan_req_fd);
+        scan_req_fd = -1;
+        pthread_mutex_unlock(&scan_lock);
+        scanning = 0;
+        dir_partial = 1;
+    }
+    listing_stash(&dir_listing);
+    view_clear();
+    name_hash_n = 0;
+    filter_len = 0;
+    goto_mode = 1;
+
+    listing_adopt(&index_listing);
+    if (!index_fresh()) {
+        nentries = 0;
+        names_len = 0;
+        nmetas = 0;
+        index_begin();
+    } else {
+        /* sizes and times may have moved on; stat again on demand */
+        for (i = 0; i < nentries; i++) entries[i].meta = -1;
+        nmetas = 0;
+    }
+    view_sync();
+    reset_view();
+}
+
+/*
+ * Back to the directory listing; a complete index is kept for later.
+ * When away is set the caller reads another directory next, so the
+ * listing is only put back for the cache, or dropped if it was cut
+ * short, and is neither shown nor read again here.
+ */
+static void goto_leave(int away)
+{
+    int i;
+
+    if (!goto_mode) return;
+
+    if (index_walking) {
+        /* abandon the walk; the workers notice and drop their tasks */
+        __atomic_add_fetch(&index_gen, 1, __ATOMIC_ACQ_REL);
+        index_walking = 0;
+        nentries = 0;
+    }
+    listing_stash(&index_listing);
+    view_clear();
+    name_hash_n = 0;
+    filter_len = 0;
+    goto_mode = 0;
+
+    listing_adopt(&dir_listing);
+    /* sniffs it was waiting for went to the index listing */
+    for (i = 0; i < nmetas; i++) {
+        if (metas[i].ftype == FT_QUEUED) metas[i].ftype = FT_UNKNOWN;
+    }
+    if (dir_partial) {
+        dir_partial = 0;
+        nentries = 0;
+        if (away) return;
+        read_dir();
+    } else {
+        if (away) return;
+        view_sync();
+    }
+    reset_view();
+}
+
+/*
+ * File types by content. Rows drawn for regular files whose type is
+ * not known yet queue them into a SniffBatch; after the frame the batch
+ * goes to the indexer pool, whose worker reads the first SNIFF_BYTES
+ * of each file and matches them against sniff_sigs[]. The types land
+ * in the entries' Meta, and in type_cache by (dev, ino, mtime) so a
+ * file is not read again when its directory is visited again.
+ */
+
+/*
+ * Group the offset-0 signatures by first byte, longest first, so a
+ * file head is only compared with the few that can match.
+ */
+static void sniff_compile(void)
+{
+    int count[257];
+    int i, j, b;
+    unsigned char t;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < NSIGS; i++) {
+        if (sniff_sigs[i].off == 0) {
+            count[(unsigned char)sniff_sigs[i].magic[0] + 1]++;
+        } else {
+            sniff_rest[sniff_nrest++] = i;
+        }
+    }
+    for (b = 0; b < 256; b++) count[b + 1] += count[b];
+    memcpy(sniff_first, count, sizeof(sniff_first));
+    for (i = 0; i < NSIGS; i++) {
+        if (sniff_sigs[i].off != 0) continue;
+        b = (unsigned char)sniff_sigs[i].magic[0];
+        j = count[b]++;
+        sniff_by_byte[j] = i;
+        /* insertion by length within the group */
+        while (j > sniff_first[b] &&
+               sniff_sigs[sniff_by_byte[j - 1]].len < sniff_sigs[i].len) {
+            t = sniff_by_byte[j - 1];
+            sniff_by_byte[j - 1] = sniff_by_byte[j];
+            sniff_by_byte[j] = t;
+            j--;
+        }
+    }
+    sniff_compiled = 1;
+}
+
+/* Type of a file from its first n bytes */
+static int sniff_match(const unsigned char *buf, size_t n)
+{
+    const SniffSig *s;
+    size_t i, ctl = 0;
+    int k;
+
+    if (n == 0) return FT_EMPTY;
+    for (k = sniff_first[buf[0]]; k < sniff_first[buf[0] + 1]; k++) {
+        s = &sniff_sigs[sniff_by_byte[k]];
+        if (n >= s->len && memcmp(buf, s->magic, s->len) == 0) return s->type;
+    }
+    for (k = 0; k < sniff_nrest; k++) {
+        s = &sniff_sigs[sniff_rest[k]];
+        if (n >= (size_t)s->off + s->len &&
+            memcmp(buf + s->off, s->magic, s->len) == 0) {
+            return s->type;
+        }
+    }
+    /* no NUL and few control characters: some kind of text */
+    for (i = 0; i < n; i++) {
+        if (buf[i] == 0) return FT_DATA;
+        if (buf[i] < 0x20 && buf[i] != '\n' && buf[i] != '\t' &&
+            buf[i] != '\r' && buf[i] != '\f' && buf[i] != 0x1b) {
+            ctl++;
+        }
+    }
+    return ctl * 10 > n ? FT_DATA : FT_TEXT;
+}
+
+/* Pool task: sniff a batch of files under d->fd and hand it back */
+static void sniff_run(IndexDir *d)
+{
+    unsigned char buf[SNIFF_BYTES];
+    SniffBatch *sb = d->sniff;
+    struct stat st;
+    ssize_t n;
+    int fd;
+    int i;
+
+    for (i = 0; i < sb->n; i++) {
+        sb->type[i] = FT_UNREADABLE;
+        if (__atomic_load_n(&sniff_gen, __ATOMIC_ACQUIRE) != sb->gen) break;
+        fd = openat(d->fd, sb->names + sb->name_off[i],
+                    O_RDONLY | O_NONBLOCK | O_NOCTTY);
+        if (fd < 0) continue;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            n = pread(fd, buf, sizeof(buf), 0);
+            if (n >= 0) sb->type[i] = sniff_match(buf, n);
+            sb->dev[i] = st.st_dev;
+            sb->ino[i] = st.st_ino;
+            sb->mtime[i] = st.st_mtime;
+        }
+        close(fd);
+    }
+    index_release(d);
+
+    pthread_mutex_lock(&sniff_lock);
+    sb->next = sniff_ready;
+    sniff_ready = sb;
+    pthread_mutex_unlock(&sniff_lock);
+    if (write(wake_pipe[1], "t", 1) < 0 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+static TypeRec *type_slot(dev_t dev, ino_t ino)
+{
+    return &type_cache[((unsigned long)ino * 2654435761u + dev) &
+                       (TYPE_CACHE - 1)];
+}
+
+/*
+ * Type of regular file idx for its row: known, or queued now for the
+ * next batch. Returns FT_QUEUED while it is not known yet.
+ */
+static int sniff_type(int idx, Meta *m)
+{
+    SniffBatch *sb;
+    TypeRec *t;
+    const char *name;
+    size_t len;
+    char *tmp;
+
+    if (m->ftype != FT_UNKNOWN) return m->ftype;
+    t = type_slot(m->dev, m->ino);
+    if (t->type != FT_UNKNOWN && t->ino == m->ino && t->dev == m->dev &&
+        t->mtime == m->mtime) {
+        m->ftype = t->type;
+        return m->ftype;
+    }
+
+    if (sniff_pending == NULL) {
+        sniff_pending = (SniffBatch*)calloc(1, sizeof(SniffBatch));
+        if (sniff_pending == NULL) return FT_QUEUED;
+        sniff_pending->gen = __atomic_load_n(&sniff_gen, __ATOMIC_ACQUIRE);
+    }
+    sb = sniff_pending;
+    name = entry_name(idx);
+    len = strlen(name);
+    if (sb->names_len + len + 1 > sb->names_cap) {
+        tmp = (char*)realloc(sb->names, sb->names_cap * 2 + len + 256);
+        if (tmp == NULL) return FT_QUEUED;
+        sb->names = tmp;
+        sb->names_cap = sb->names_cap * 2 + len + 256;
+    }
+    sb->meta[sb->n] = entries[idx].meta;
+    /* what it was queued as; the worker's fstat() replaces it */
+    sb->dev[sb->n] = m->dev;
+    sb->ino[sb->n] = m->ino;
+    sb->name_off[sb->n] = sb->names_len;
+    memcpy(sb->names + sb->names_len, name, len + 1);
+    sb->names_len += len + 1;
+    sb->n++;
+    m->ftype = FT_QUEUED;
+    if (sb->n == SNIFF_BATCH) sniff_flush();
+    return FT_QUEUED;
+}
+
+/* Hand the files queued so far to the pool */
+static void sniff_flush(void)
+{
+    SniffBatch *sb = sniff_pending;
+    IndexDir *d;
+    int i;
+
+    if (sb == NULL || sb->n == 0) return;
+    sniff_pending = NULL;
+    if (!sniff_compiled) sniff_compile();
+    d = NULL;
+    if (dir_fd >= 0 && index_start() == 0) d = index_dir_new(NULL, "", 0, 0);
+    if (d != NULL) {
+        d->fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+        d->sniff = sb;
+    }
+    if (d == NULL || d->fd < 0 || index_push(0, d) < 0) {
+        /* let the rows ask again */
+        for (i = 0; i < sb->n; i++) metas[sb->meta[i]].ftype = FT_UNKNOWN;
+        if (d != NULL) index_release(d);
+        free(sb->names);
+        free(sb);
+    }
+}
+
+/*
+ * The metas that sniffs refer to are going away: answers still coming
+ * are dropped, and what was gathered for the next batch is forgotten
+ */
+static void sniff_drop(void)
+{
+    __atomic_add_fetch(&sniff_gen, 1, __ATOMIC_RELEASE);
+    if (sniff_pending != NULL) {
+        sniff_pending->n = 0;
+        sniff_pending->names_len = 0;
+        sniff_pending->gen = __atomic_load_n(&sniff_gen, __ATOMIC_ACQUIRE);
+    }
+}
+
+/* Take the types of finished batches; stale ones are just dropped */
+static void sniff_collect(void)
+{
+    SniffBatch *list, *sb;
+    unsigned long gen = __atomic_load_n(&sniff_gen, __ATOMIC_ACQUIRE);
+    TypeRec *t;
+    Meta *m;
+    int shown = 0;
+    int i;
+
+    pthread_mutex_lock(&sniff_lock);
+    list = sniff_ready;
+    sniff_ready = NULL;
+    pthread_mutex_unlock(&sniff_lock);
+
+    while (list != NULL) {
+        sb = list;
+        list = sb->next;
+        for (i = 0; i < sb->n && sb->gen == gen; i++) {
+            if (sb->type[i] != FT_UNREADABLE) {
+                t = type_slot(sb->dev[i], sb->ino[i]);
+                t->dev = sb->dev[i];
+                t->ino = sb->ino[i];
+                t->mtime = sb->mtime[i];
+                t->type = sb->type[i];
+            }
+            /* the listing may have been swapped meanwhile: check it is ours */
+            if (sb->meta[i] >= nmetas) continue;
+            m = &metas[sb->meta[i]];
+            if (m->ftype != FT_QUEUED) continue;
+            if (m->dev != sb->dev[i] || m->ino != sb->ino[i]) continue;
+            m->ftype = sb->type[i];
+            shown = 1;
+        }
+        free(sb->names);
+        free(sb);
+    }
+    if (shown) damage_rows(scroll_top, scroll_top + LIST_ROWS);
+}
+
+/*
+ * Directory sizes. Each directory row gets a SizeJob that totals the
+ * file sizes below it on the indexer pool, one task per directory like
+ * the subtree index. Files with more than one link are counted once per
+ * job, by (dev, ino). The result is kept in a SizeRec keyed by the
+ * directory's (dev, ino) and reused while the directory's mtime is
+ * unchanged; until then the row shows the running total.
+ */
+
+/* Has the job seen this inode before? Records it if not */
+static int size_seen(SizeJob *job, dev_t dev, ino_t ino)
+{
+    InodeKey *tmp, *old;
+    unsigned long h;
+    int cap, oldcap;
+    int i;
+    int found = 0;
+
+    pthread_mutex_lock(&job->lock);
+    if ((job->nseen + 1) * 2 > job->seen_cap) {
+        old = job->seen;
+        oldcap = job->seen_cap;
+        cap = oldcap ? oldcap * 2 : 256;
+        tmp = (InodeKey*)calloc(cap, sizeof(InodeKey));
+        if (tmp == NULL) {
+            /* no room to remember it: count it rather than lose it */
+            pthread_mutex_unlock(&job->lock);
+            return 0;
+        }
+        job->seen = tmp;
+        job->seen_cap = cap;
+        for (i = 0; i < oldcap; i++) {
+            if (old[i].ino == 0) continue;
+            h = (unsigned long)old[i].ino * 2654435761u + old[i].dev;
+            while (tmp[h & (cap - 1)].ino != 0) h++;
+            tmp[h & (cap - 1)] = old[i];
+        }
+        free(old);
+    }
+    h = (unsigned long)ino * 2654435761u + dev;
+    for (;; h++) {
+        i = h & (job->seen_cap - 1);
+        if (job->seen[i].ino == 0) {
+            job->seen[i].dev = dev;
+            job->seen[i].ino = ino;
+            job->nseen++;
+            break;
+        }
+        if (job->seen[i].ino == ino && job->seen[i].dev == dev) {
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    return found;
+}
+
+/* Drop a reference to a job; the last one frees it */
+static void size_job_release(SizeJob *job)
+{
+    if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    pthread_mutex_destroy(&job->lock);
+    free(job->seen);
+    free(job);
+}
+
+/* A directory of the job is done; the last one completes the job */
+static void size_task_end(SizeJob *job)
+{
+    if (__atomic_sub_fetch(&job->left, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+        if (write(wake_pipe[1], "z", 1) < 0 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+    size_job_release(job);
+}
+
+/* Pool task: add up one directory, queue its subdirectories */
+static void size_walk(int w, IndexDir *d)
+{
+    SizeJob *job = d->job;
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    IndexDir *child;
+    long long sum = 0;
+    int fd;
+    int n = 0;
+
+    if (job->gen != __atomic_load_n(&size_gen, __ATOMIC_ACQUIRE)) {
+        /* the user has moved on */
+        if (d->parent) index_release(d->parent);
+        index_release(d);
+        size_task_end(job);
+        return;
+    }
+    if (d->parent != NULL) {
+        d->fd = openat(d->parent->fd, d->path, O_RDONLY | O_DIRECTORY |
+                       O_NOFOLLOW);
+        if (d->fd >= 0) fcntl(d->fd, F_SETFD, FD_CLOEXEC);
+        index_release(d->parent);
+    }
+    fd = d->fd >= 0 ? dup(d->fd) : -1;
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0) close(fd);
+        index_release(d);
+        size_task_end(job);
+        return;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0) continue;
+        if (strcmp(de->d_name, "..") == 0) continue;
+        if (fstatat(d->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            /* like du -x: mounts below, /proc and the like, are not ours */
+            if (st.st_dev != job->dev) continue;
+            child = index_dir_new(d, de->d_name, strlen(de->d_name), 0);
+            if (child == NULL) continue;
+            __atomic_add_fetch(&d->refs, 1, __ATOMIC_ACQ_REL);
+            __atomic_add_fetch(&job->refs, 1, __ATOMIC_ACQ_REL);
+            __atomic_add_fetch(&job->left, 1, __ATOMIC_ACQ_REL);
+            if (index_push(w, child) < 0) {
+                index_release(d);
+                index_release(child);
+                size_task_end(job);
+            }
+            continue;
+        }
+        if (st.st_nlink > 1 && size_seen(job, st.st_dev, st.st_ino)) continue;
+        sum += st.st_size;
+
+        /* let the running total show progress in big directories */
+        if (++n == SCAN_BATCH) {
+            __atomic_add_fetch(&job->total, sum, __ATOMIC_RELAXED);
+            sum = 0;
+            n = 0;
+            if (job->gen != __atomic_load_n(&size_gen, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+        }
+    }
+    __atomic_add_fetch(&job->total, sum, __ATOMIC_RELAXED);
+    closedir(dir);
+    index_release(d);
+    size_task_end(job);
+}
+
+/* The record for a directory inode, or NULL */
+static SizeRec *size_find(dev_t dev, ino_t ino)
+{
+    SizeRec *r;
+
+    if (size_buckets == 0) return NULL;
+    r = size_table[((unsigned long)ino * 2654435761u + dev) &
+                   (size_buckets - 1)];
+    while (r != NULL && (r->ino != ino || r->dev != dev)) r = r->next;
+    return r;
+}
+
+/* Add a record; the table doubles once it holds a record per bucket */
+static SizeRec *size_add(dev_t dev, ino_t ino)
+{
+    SizeRec **tmp;
+    SizeRec *r, *next;
+    unsigned long h;
+    int cap;
+    int i;
+
+    if (size_nrecs >= size_buckets) {
+        cap = size_buckets ? size_buckets * 2 : 256;
+        tmp = (SizeRec**)calloc(cap, sizeof(SizeRec*));
+        if (tmp == NULL) return NULL;
+        for (i = 0; i < size_buckets; i++) {
+            for (r = size_table[i]; r != NULL; r = next) {
+                next = r->next;
+                h = ((unsigned long)r->ino * 2654435761u + r->dev) & (cap - 1);
+                r->next = tmp[h];
+                tmp[h] = r;
+            }
+        }
+        free(size_table);
+        size_table = tmp;
+        size_buckets = cap;
+    }
+    r = (SizeRec*)calloc(1, sizeof(SizeRec));
+    if (r == NULL) return NULL;
+    r->dev = dev;
+    r->ino = ino;
+    h = ((unsigned long)ino * 2654435761u + dev) & (size_buckets - 1);
+    r->next = size_table[h];
+    size_table[h] = r;
+    size_nrecs++;
+    return r;
+}
+
+/*
+ * Size of directory entry idx for its row: the kept total, or the
+ * running one while *partial is set. Starts the job the first time.
+ * Returns -1 if there is nothing to show.
+ *
+ * A directory's mtime only tells of changes right inside it, not of
+ * files growing further down, so a kept total is only trusted for the
+ * visit it was counted in. The next time the listing is read it is
+ * counted again, showing the old total until the new one passes it.
+ */
+static long long size_of_dir(int idx, int *partial)
+{
+    SizeRec *r;
+    SizeJob *job;
+    IndexDir *d;
+    Meta *m;
+    SizeRec **tmp;
+    long long total;
+    int fd;
+
+    *partial = 0;
+    if (goto_mode || is_dotdot(idx)) return -1;
+    m = entry_meta(idx);
+    if (m == NULL || !S_ISDIR(m->mode)) return -1;
+
+    r = size_find(m->dev, m->ino);
+    if (r != NULL && r->job != NULL) {
+        *partial = 1;
+        total = __atomic_load_n(&r->job->total, __ATOMIC_RELAXED);
+        return total > r->total ? total : r->total;
+    }
+    if (r != NULL && r->mtime == m->mtime && r->visit == size_visit) {
+        return r->total;
+    }
+
+    /* first visit, a new one, or the directory changed: count it again */
+    if (r == NULL) r = size_add(m->dev, m->ino);
+    if (r == NULL || index_start() < 0) return -1;
+    if (nsize_running == size_running_cap) {
+        tmp = (SizeRec**)realloc(size_running, sizeof(SizeRec*) *
+                                 (size_running_cap ? size_running_cap * 2 : 64));
+        if (tmp == NULL) return -1;
+        size_running = tmp;
+        size_running_cap = size_running_cap ? size_running_cap * 2 : 64;
+    }
+    fd = openat(dir_fd, entry_name(idx), O_RDONLY | O_DIRECTORY);
+    job = (SizeJob*)calloc(1, sizeof(SizeJob));
+    d = index_dir_new(NULL, "", 0, 0);
+    if (fd < 0 || job == NULL || d == NULL) {
+        if (fd >= 0) close(fd);
+        free(job);
+        free(d);
+        r->mtime = m->mtime;
+        r->visit = size_visit;
+        r->total = -1;
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    pthread_mutex_init(&job->lock, NULL);
+    job->gen = __atomic_load_n(&size_gen, __ATOMIC_ACQUIRE);
+    job->dev = m->dev;
+    job->left = 1;
+    job->refs = 2;          /* the UI and the root task */
+    d->fd = fd;
+    d->job = job;
+    r->job = job;
+    r->mtime = m->mtime;
+    r->visit = size_visit;
+    size_running[nsize_running++] = r;
+    if (index_push(0, d) < 0) {
+        index_release(d);
+        size_task_end(job);
+    }
+    *partial = 1;
+    return 0;
+}
+
+/* Keep the totals of finished jobs; returns nonzero if any finished */
+static int size_collect(void)
+{
+    SizeRec *r;
+    int i, j;
+    int done = 0;
+
+    for (i = 0, j = 0; i < nsize_running; i++) {
+        r = size_running[i];
+        if (__atomic_load_n(&r->job->done, __ATOMIC_ACQUIRE)) {
+            r->total = r->job->total;
+            size_job_release(r->job);
+            r->job = NULL;
+            done = 1;
+        } else {
+            size_running[j++] = r;
+        }
+    }
+    nsize_running = j;
+    if (done) damage_rows(scroll_top, scroll_top + LIST_ROWS);
+    return done;
+}
+
+/*
+ * Leaving the directory: running jobs are abandoned and their records
+ * forgotten, so the next visit starts over. Finished totals stay.
+ */
+static void size_cancel(void)
+{
+    int i;
+
+    if (nsize_running == 0) return;
+    __atomic_add_fetch(&size_gen, 1, __ATOMIC_ACQ_REL);
+    for (i = 0; i < nsize_running; i++) {
+        size_job_release(size_running[i]->job);
+        size_running[i]->job = NULL;
+        size_running[i]->mtime = 0;
+    }
+    nsize_running = 0;
+}
+
+/*
+ * Called by the main loop: while totals are still growing, redraw the
+ * rows every SIZE_TICK_MS. Returns the milliseconds to the next tick,
+ * or -1 if nothing is running.
+ */
+static int size_tick(const struct timespec *now)
+{
+    long ms;
+
+    if (nsize_running == 0) return -1;
+    ms = elapsed_ms(&size_last_tick, now);
+    if (ms < SIZE_TICK_MS) return SIZE_TICK_MS - ms;
+    size_last_tick = *now;
+    damage_rows(scroll_top, scroll_top + LIST_ROWS);
+    return SIZE_TICK_MS;
+}
+
+/* Human readable size: 999, 1.5K, 12M, 3.2G */
+static void format_size(char *buf, long long n)
+{
+    static const char units[] = "KMGTPE";
+    double v = n;
+    int u = -1;
+
+    if (n < 1000) {
+        sprintf(buf, "%lld", n);
+        return;
+    }
+    while (v >= 1000 && u < 5) {
+        v /= 1024;
+        u++;
+    }
+    sprintf(buf, v < 10 ? "%.1f%c" : "%.0f%c", v, units[u]);
+}
+
+/* Add a window rectangle to the area the next draw_list() re-renders */
+static void damage_rect(int x, int y, int w, int h)
+{
+    XRectangle r;
+
+    r.x = x;
+    r.y = y;
+    r.width = w;
+    r.height = h;
+    XUnionRectWithRegion(&r, damage, damage);
+}
+
+/*
+ * Mark rows [first, last) of the view for re-rendering. They are kept as
+ * row ranges and only turned into window positions at render time, so
+ * any number of scrolls in between cannot put the damage in the wrong
+ * place.
+ */
+static void damage_rows(int first, int last)
+{
+    if (first < 0) first = 0;
+    if (first >= last) return;
+    if (ndirty == DIRTY_MAX) {
+        dirty_overflow = 1;
+        return;
+    }
+    dirty_first[ndirty] = first;
+    dirty_last[ndirty] = last;
+    ndirty++;
+}
+
+static void damage_all(void)
+{
+    damage_rect(0, 0, WINDOW_W, WINDOW_H);
+}
+
+/* Draw one list row, background included */
+static void draw_row(int row)
+{
+    char display[1024];
+    int y = LIST_Y + (row - scroll_top) * LINE_HEIGHT;
+    int idx = view[row].idx;
+    long long size = -1;
+    const char *type = "";
+    int partial = 0;
+    int cw = fontinfo->max_bounds.width;
+    int size_x = LIST_X + LIST_W - SCROLLBAR_W - 4;
+    int type_x = size_x - 16 * cw;
+    int n;
+    Meta *m;
+
+    if (row == selected) {
+        /* draw selection rectangle */
+        XSetForeground(dpy, gc, 0xAAAAAA);
+        XFillRectangle(dpy, backbuf, gc, LIST_X, y,
+                      LIST_W - SCROLLBAR_W, LINE_HEIGHT);
+        XSetForeground(dpy, gc, black_pixel);
+    }
+    if (entries[idx].flags & E_DIR) {
+        snprintf(display, sizeof(display), "%s/", entry_name(idx));
+    } else {
+        snprintf(display, sizeof(display), "%s", entry_name(idx));
+    }
+    /* long names stop short of the columns, marked with a ~ */
+    n = strlen(display);
+    if (cw > 0 && n > (type_x - LIST_X - 4) / cw - 1) {
+        n = (type_x - LIST_X - 4) / cw - 1;
+        if (n < 1) n = 1;
+        display[n - 1] = '~';
+    }
+    XDrawString(dpy, backbuf, gc, LIST_X + 4, y + fontinfo->ascent,
+                display, n);
+
+    /*
+     * type and size columns: files from their metadata and contents,
+     * directories in total
+     */
+    if (entries[idx].flags & E_DIR) {
+        size = size_of_dir(idx, &partial);
+        type = "dir";
+    } else if ((m = entry_meta(idx)) != NULL && m->mode != 0) {
+        size = m->size;
+        if (S_ISREG(m->mode)) {
+            type = ftype_names[sniff_type(idx, m)];
+        } else if (S_ISFIFO(m->mode)) {
+            type = "fifo";
+        } else if (S_ISSOCK(m->mode)) {
+            type = "socket";
+        } else {
+            type = "device";
+        }
+    }
+    XDrawString(dpy, backbuf, gc, type_x, y + fontinfo->ascent,
+                type, strlen(type));
+    if (size >= 0) {
+        format_size(display, size);
+        if (partial) strcat(display, "+");
+        n = strlen(display);
+        XDrawString(dpy, backbuf, gc,
+                    LIST_X + LIST_W - SCROLLBAR_W - 4 -
+                    XTextWidth(fontinfo, display, n),
+                    y + fontinfo->ascent, display, n);
+    }
+}
+
+/* Path and selection details along the bottom */
+static void draw_status(void)
+{
+    char display[64];
+    const char *cwd = cwd_path();
+    int n;
+    int x;
+    Meta *e;
+
+    /* draw cwd at bottom, then the sort order */
+    XDrawString(dpy, backbuf, gc, LIST_X, WINDOW_H - MARGIN, cwd, strlen(cwd));
+    n = sprintf(display, "[%s%s]%s", sort_names[sort_mode],
+                sort_reverse ? ", reversed" : "",
+                !goto_mode ? "" : index_walking ? " goto, indexing..."
+                                                : " goto");
+    x = LIST_X + XTextWidth(fontinfo, cwd, strlen(cwd)) + 16;
+    XDrawString(dpy, backbuf, gc, x, WINDOW_H - MARGIN, display, n);
+
+    /* messages, like a viewer that could not start, go before the filter */
+    if (status_msg[0] != '\0') {
+        x += XTextWidth(fontinfo, display, n) + 16;
+        XDrawString(dpy, backbuf, gc, x, WINDOW_H - MARGIN,
+                    status_msg, strlen(status_msg));
+    } else if (filter_len > 0) {
+        x += XTextWidth(fontinfo, display, n) + 16;
+        n = sprintf(display, "%s: %d/%d  ", filter_fuzzy ? "fuzzy" : "filter",
+                    nview, norder);
+        XDrawString(dpy, backbuf, gc, x, WINDOW_H - MARGIN, display, n);
+        x += XTextWidth(fontinfo, display, n);
+        XDrawString(dpy, backbuf, gc, x, WINDOW_H - MARGIN,
+                    filter, filter_len);
+    }
+
+    /* size and mtime of the selection, stat'ed only now */
+    e = entry_meta(selected >= 0 ? view[selected].idx : -1);
+    if (e != NULL && e->mtime != 0) {
+        n = sprintf(display, "%10ld  ", (long)e->size);
+        strftime(display + n, sizeof(display) - n, "%Y-%m-%d %H:%M",
+                 localtime(&e->mtime));
+        XDrawString(dpy, backbuf, gc,
+                    WINDOW_W - MARGIN - XTextWidth(fontinfo, display,
+                                                   strlen(display)),
+                    WINDOW_H - MARGIN, display, strlen(display));
+    }
+}
+
+/* Span statistics over the top right of the list */
+static void draw_hud(void)
+{
+    char display[64];
+    Hist *h;
+    int x = HUD_X;
+    int y = HUD_Y;
+    int n;
+    int s;
+
+    XSetForeground(dpy, gc, 0xFFFFE0);
+    XFillRectangle(dpy, backbuf, gc, x, y, HUD_W, HUD_H);
+    XSetForeground(dpy, gc, black_pixel);
+    XDrawRectangle(dpy, backbuf, gc, x, y, HUD_W - 1, HUD_H - 1);
+
+    n = sprintf(display, "%-7s %7s %8s %8s %8s", "ms", "count", "p50",
+                "p99", "max");
+    XDrawString(dpy, backbuf, gc, x + 4, y + fontinfo->ascent + 2,
+                display, n);
+    for (s = 0; s < SPANS; s++) {
+        h = &span_hist[s];
+        y += LINE_HEIGHT;
+        n = sprintf(display, "%-7s %7lu %8.2f %8.2f %8.2f", span_names[s],
+                    h->count, hist_pct(h, 50) / 1000.0,
+                    hist_pct(h, 99) / 1000.0, h->max_us / 1000.0);
+        XDrawString(dpy, backbuf, gc, x + 4, y + fontinfo->ascent + 2,
+                    display, n);
+    }
+}
+
+/*
+ * Jobs over the bottom of the list: each with a bar of its progress,
+ * the bytes so far, the rate since it started and the time left at it
+ */
+static void draw_jobs(void)
+{
+    char display[256];
+    char done[16], total[16], rate[16];
+    Job *j;
+    long long t = now_us();
+    long long d, n, left;
+    double bps;
+    int y = JOBS_Y + 2;
+    int shown = 0, more = 0;
+    int len, state;
+
+    XSetForeground(dpy, gc, 0xFFFFE0);
+    XFillRectangle(dpy, backbuf, gc, JOBS_X, JOBS_Y, JOBS_W, JOBS_H);
+    XSetForeground(dpy, gc, black_pixel);
+    XDrawRectangle(dpy, backbuf, gc, JOBS_X, JOBS_Y, JOBS_W - 1, JOBS_H - 1);
+
+    pthread_mutex_lock(&fileop_lock);
+    for (j = jobs; j != NULL; j = j->next) {
+        if (shown == JOBS_SHOWN - 1 && njobs > JOBS_SHOWN) {
+            more++;
+            continue;
+        }
+        state = __atomic_load_n(&j->state, __ATOMIC_ACQUIRE);
+        len = snprintf(display, sizeof(display), "%s %s  ", job_ops[j->op],
+                       j->name);
+        if (state == JOB_QUEUED) {
+            snprintf(display + len, sizeof(display) - len, "queued");
+        } else if (state == JOB_DONE) {
+            snprintf(display + len, sizeof(display) - len, "%s",
+                     j->err == 0 ? "done" : j->err == ECANCELED ?
+                     "cancelled" : strerror(j->err));
+        } else if (j->op == JOB_DELETE) {
+            /* no count up front, that would walk the tree twice */
+            d = __atomic_load_n(&j->done, __ATOMIC_RELAXED);
+            snprintf(display + len, sizeof(display) - len,
+                     "%lld removed  %.0f/s", d, t > j->start_us ?
+                     d * 1e6 / (t - j->start_us) : 0.0);
+        } else if ((n = __atomic_load_n(&j->total, __ATOMIC_RELAXED)) < 0) {
+            snprintf(display + len, sizeof(display) - len, "counting...");
+        } else {
+            /* files can grow while they are copied */
+            d = __atomic_load_n(&j->done, __ATOMIC_RELAXED);
+            if (d > n) n = d;
+            bps = t > j->start_us ? d * 1e6 / (t - j->start_us) : 0;
+            left = bps > 0 ? (long long)((n - d) / bps) : -1;
+            if (n > 0) {
+                XSetForeground(dpy, gc, 0xC0D8F0);
+                XFillRectangle(dpy, backbuf, gc, JOBS_X + 1, y,
+                               (int)((JOBS_W - 2) * d / n), LINE_HEIGHT);
+                XSetForeground(dpy, gc, black_pixel);
+            }
+            format_size(done, d);
+            format_size(total, n);
+            format_size(rate, (long long)bps);
+            len += snprintf(display + len, sizeof(display) - len,
+                            "%d%%  %s/%s  %s/s", n > 0 ? (int)(d * 100 / n)
+                                                       : 100,
+                            done, total, rate);
+            if (left >= 0) {
+                snprintf(display + len, sizeof(display) - len,
+                         "  %lld:%02lld left", left / 60, left % 60);
+            }
+        }
+        XDrawString(dpy, backbuf, gc, JOBS_X + 4, y + fontinfo->ascent,
+                    display, strlen(display));
+        y += LINE_HEIGHT;
+        shown++;
+    }
+    pthread_mutex_unlock(&fileop_lock);
+    if (more > 0) {
+        len = sprintf(display, "and %d more", more);
+        XDrawString(dpy, backbuf, gc, JOBS_X + 4, y + fontinfo->ascent,
+                    display, len);
+    }
+}
+
+/*
+ * Re-render the damaged part of backbuf. Only rows that intersect the
+ * damage are drawn, and the GC is clipped to it, so moving the
+ * selection touches two rows instead of the whole window. The area
+ * then waits in the present region for draw_list() to show it.
+ */
+static void render_damage(void)
+{
+    XRectangle box;
+    int i;
+    int first, last;
+    int th, ty;
+
+    if (XEmptyRegion(damage)) return;
+    XClipBox(damage, &box);
+    XSetRegion(dpy, gc, damage);
+
+    /* clear */
+    XSetForeground(dpy, gc, white_pixel);
+    XFillRectangle(dpy, backbuf, gc, box.x, box.y, box.width, box.height);
+
+    XSetForeground(dpy, gc, black_pixel);
+    first = scroll_top + (box.y - LIST_Y) / LINE_HEIGHT;
+    last = scroll_top + (box.y + box.height - LIST_Y + LINE_HEIGHT - 1) /
+           LINE_HEIGHT;
+    if (first < scroll_top) first = scroll_top;
+    if (last > scroll_top + LIST_ROWS) last = scroll_top + LIST_ROWS;
+    if (last > nview) last = nview;
+    for (i = first; i < last; i++) {
+        draw_row(i);
+    }
+
+    /* scrollbar thumb, only when the list does not fit */
+    if (nview > LIST_ROWS &&
+        box.x + box.width > LIST_X + LIST_W - SCROLLBAR_W) {
+        th = LIST_H * LIST_ROWS / nview;
+        if (th < 8) th = 8;
+        ty = LIST_Y + (int)((long)(LIST_H - th) * scroll_top /
+                            (nview - LIST_ROWS));
+        XSetForeground(dpy, gc, 0xAAAAAA);
+        XFillRectangle(dpy, backbuf, gc, LIST_X + LIST_W - SCROLLBAR_W, ty,
+                       SCROLLBAR_W, th);
+        XSetForeground(dpy, gc, black_pixel);
+    }
+
+    if (box.y + box.height > LIST_Y + LIST_H) {
+        draw_status();
+    }
+    if (preview_on && box.x + box.width > PREVIEW_X - MARGIN &&
+        box.y < LIST_Y + LIST_H) {
+        draw_preview();
+    }
+    if (njobs > 0 && box.y + box.height > JOBS_Y && box.y < JOBS_Y + JOBS_H) {
+        draw_jobs();
+    }
+    if (hud_on && box.x + box.width > HUD_X && box.y < HUD_Y + HUD_H) {
+        draw_hud();
+    }
+
+    XSetClipMask(dpy, gc, None);
+    XUnionRegion(present, damage, present);
+    XDestroyRegion(damage);
+    damage = XCreateRegion();
+}
+
+/*
+ * Bring the window up to date: shift for any scrolling, render whatever
+ * is damaged, then show it with a single XCopyArea of the bounding box.
+ * backbuf is complete everywhere, so copying a little more than needed
+ * is harmless. Called once per frame by the main loop.
+ */
+static void draw_list(void)
+{
+    XRectangle box;
+    long long t = now_us();
+    int i;
+    int first, last;
+
+    sync_scroll();
+    if (hud_dirty) {
+        damage_rect(HUD_X, HUD_Y, HUD_W, HUD_H);
+        hud_dirty = 0;
+    }
+
+    /* dirty entries become rows at the final scroll offset */
+    if (dirty_overflow) {
+        damage_rect(LIST_X, LIST_Y, LIST_W - SCROLLBAR_W, LIST_H);
+    }
+    for (i = 0; i < ndirty && !dirty_overflow; i++) {
+        first = dirty_first[i];
+        last = dirty_last[i];
+        if (first < scroll_top) first = scroll_top;
+        if (last > scroll_top + LIST_ROWS) last = scroll_top + LIST_ROWS;
+        if (first >= last) continue;
+        damage_rect(LIST_X, LIST_Y + (first - scroll_top) * LINE_HEIGHT,
+                    LIST_W - SCROLLBAR_W, (last - first) * LINE_HEIGHT);
+    }
+    ndirty = 0;
+    dirty_overflow = 0;
+
+    render_damage();
+    /* files the frame wanted types for */
+    sniff_flush();
+    if (XEmptyRegion(present)) return;
+    XClipBox(present, &box);
+    XCopyArea(dpy, backbuf, win, gc, box.x, box.y, box.width, box.height,
+              box.x, box.y);
+    XDestroyRegion(present);
+    present = XCreateRegion();
+    span_end(SPAN_DRAW, t);
+    if (input_since >= 0) {
+        span_end(SPAN_INPUT, input_since);
+        input_since = -1;
+    }
+}
+
+/* Clamp and set the first visible row; returns nonzero if it moved */
+static int scroll_to(int top)
+{
+    int max = nview - LIST_ROWS;
+
+    if (top > max) top = max;
+    if (top < 0) top = 0;
+    if (top == scroll_top) return 0;
+    scroll_top = top;
+    return 1;
+}
+
+/*
+ * Catch backbuf up with scroll_top before rendering. Rows that stay on
+ * screen are shifted with one XCopyArea however many scroll steps the
+ * batch contained; only rows scrolled into view and the scrollbar get
+ * damaged.
+ */
+static void sync_scroll(void)
+{
+    int delta = scroll_top - shown_top;
+    int w = LIST_W - SCROLLBAR_W;
+    XRectangle r;
+
+    if (delta == 0) return;
+    shown_top = scroll_top;
+    if (delta >= LIST_ROWS || -delta >= LIST_ROWS) {
+        damage_rect(LIST_X, LIST_Y, LIST_W, LIST_H);
+        return;
+    }
+
+    if (delta > 0) {
+        XCopyArea(dpy, backbuf, backbuf, gc,
+                  LIST_X, LIST_Y + delta * LINE_HEIGHT,
+                  w, (LIST_ROWS - delta) * LINE_HEIGHT, LIST_X, LIST_Y);
+        damage_rect(LIST_X, LIST_Y + (LIST_ROWS - delta) * LINE_HEIGHT,
+                    w, delta * LINE_HEIGHT);
+    } else {
+        XCopyArea(dpy, backbuf, backbuf, gc,
+                  LIST_X, LIST_Y, w, (LIST_ROWS + delta) * LINE_HEIGHT,
+                  LIST_X, LIST_Y - delta * LINE_HEIGHT);
+        damage_rect(LIST_X, LIST_Y, w, -delta * LINE_HEIGHT);
+    }
+    damage_rect(LIST_X + LIST_W - SCROLLBAR_W, LIST_Y, SCROLLBAR_W, LIST_H);
+
+    /* the shifted rows are valid in backbuf but not yet on screen */
+    r.x = LIST_X;
+    r.y = LIST_Y;
+    r.width = w;
+    r.height = LIST_ROWS * LINE_HEIGHT;
+    XUnionRectWithRegion(&r, present, present);
+}
+
+/* Show a fresh list from the top, e.g. after changing directory */
+static void reset_view(void)
+{
+    selected = -1;
+    scroll_top = 0;
+    shown_top = 0;
+    ndirty = 0;
+    dirty_overflow = 0;
+    damage_all();
+}
+
+/* Is there anything for the next frame to do? */
+static int draw_pending(void)
+{
+    return ndirty > 0 || dirty_overflow || scroll_top != shown_top ||
+           hud_dirty ||
+           !XEmptyRegion(damage) || !XEmptyRegion(present);
+}
+
+/* Wheel scrolling: move the viewport, drag the selection along */
+static void scroll_by(int delta)
+{
+    int sel = selected;
+
+    if (!scroll_to(scroll_top + delta)) return;
+    if (sel >= 0) {
+        if (sel < scroll_top) sel = scroll_top;
+        if (sel >= scroll_top + LIST_ROWS) sel = scroll_top + LIST_ROWS - 1;
+        if (sel != selected) {
+            damage_rows(selected, selected + 1);
+            damage_rows(sel, sel + 1);
+            damage_rect(0, LIST_Y + LIST_H, WINDOW_W,
+                        WINDOW_H - LIST_Y - LIST_H);
+            selected = sel;
+        }
+    }
+}
+
+/* Move the selection, scrolling just enough to keep it in view */
+static void select_index(int idx)
+{
+    if (nview == 0) return;
+    if (idx < 0) idx = 0;
+    if (idx >= nview) idx = nview - 1;
+    if (idx < scroll_top) {
+        scroll_to(idx);
+    } else if (idx >= scroll_top + LIST_ROWS) {
+        scroll_to(idx - LIST_ROWS + 1);
+    }
+    /* the old and the new row change, plus the status line */
+    damage_rows(selected, selected + 1);
+    damage_rows(idx, idx + 1);
+    damage_rect(0, LIST_Y + LIST_H, WINDOW_W, WINDOW_H - LIST_Y - LIST_H);
+    selected = idx;
+}
+
+/* Open a file or change directory */
+static void open_entry(int idx)
+{
+    char *name;
+    char *path;
+
+    if (idx < 0 || idx >= nentries) return;
+
+    if (entries[idx].flags & E_DIR) {
+        /* in goto mode the name is a path below cwd */
+        name = strdup(entry_name(idx));
+        if (name == NULL) return;
+        goto_leave(1);
+
+        /* change directory; if it will not open, show this one again */
+        if (strcmp(name, "..") == 0) {
+            nav_up();
+        } else {
+            nav_enter(name);
+        }
+        free(name);
+        read_dir();
+        reset_view();
+    } else {
+        /* open file with configured viewer */
+        path = entry_path(idx);
+        if (path == NULL) return;
+        launch(path);
+        free(path);
+    }
+}
+
+/*
+ * Start the viewer on path with posix_spawn(), which does not copy our
+ * page tables the way fork() would. Where the C library reports a
+ * failed exec from posix_spawn() itself, it shows up at once; otherwise
+ * the child exits 127 and launch_reap() reports it.
+ */
+static void launch(const char *path)
+{
+    posix_spawnattr_t attr;
+    sigset_t none;
+    char *argv[20];
+    Launch *tmp;
+    pid_t pid;
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    int err;
+    int i;
+
+    /* assemble argv: viewer_argv + path + NULL */
+    for (i = 0; viewer_argv[i] != NULL && i < 15; i++) {
+        argv[i] = viewer_argv[i];
+    }
+    argv[i] = (char*)path;
+    argv[i+1] = NULL;
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none);
+#ifdef POSIX_SPAWN_SETSID
+    /* detach from X's session, as setsid() did */
+    flags |= POSIX_SPAWN_SETSID;
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+    err = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        status_error("%s: %s", argv[0], strerror(err));
+        return;
+    }
+
+    if (nlaunches == launches_cap) {
+        tmp = (Launch*)realloc(launches, sizeof(Launch) *
+                               (launches_cap ? launches_cap * 2 : 8));
+        if (tmp == NULL) return;    /* still reaped, just not named */
+        launches = tmp;
+        launches_cap = launches_cap ? launches_cap * 2 : 8;
+    }
+    launches[nlaunches].pid = pid;
+    strncpy(launches[nlaunches].name, argv[0], sizeof(launches[0].name) - 1);
+    launches[nlaunches].name[sizeof(launches[0].name) - 1] = '\0';
+    nlaunches++;
+}
+
+/* Put a message in the status line until the next key */
+static void status_set(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(status_msg, sizeof(status_msg), fmt, ap);
+    va_end(ap);
+    damage_rect(0, LIST_Y + LIST_H, WINDOW_W, WINDOW_H - LIST_Y - LIST_H);
+}
+
+/* The same for a failure, which also goes to stderr */
+static void status_error(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(status_msg, sizeof(status_msg), fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "%s\n", status_msg);
+    damage_rect(0, LIST_Y + LIST_H, WINDOW_W, WINDOW_H - LIST_Y - LIST_H);
+}
+
+/*
+ * Collect exited viewers; called from the main loop once SIGCHLD has
+ * woken it. Only a viewer that failed is worth a message.
+ */
+static void launch_reap(void)
+{
+    pid_t pid;
+    int status;
+    int i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < nlaunches && launches[i].pid != pid; i++) ;
+        if (i == nlaunches) continue;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+            status_error("%s: could not be run", launches[i].name);
+        } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            status_error("%s exited with status %d", launches[i].name,
+                         WEXITSTATUS(status));
+        } else if (WIFSIGNALED(status)) {
+            status_error("%s killed by signal %d", launches[i].name,
+                         WTERMSIG(status));
+        }
+        launches[i] = launches[--nlaunches];
+    }
+}
+
+/*
+ * Copy, move and delete jobs. Ctrl-C or Ctrl-X marks the selection,
+ * Ctrl-Y queues a job that copies or moves it into the current
+ * directory, Delete queues one that removes it once confirmed, and
+ * Ctrl-K cancels them all. FILEOP_THREADS threads take the jobs in
+ * order, so the window never waits on a disk; it only reads their byte
+ * counters on a tick to draw progress, rate and time left. Files are
+ * cloned where the filesystem can share extents, else copied inside
+ * the kernel with copy_file_range() or sendfile(), and read and written
+ * here only as a last resort. A move within one filesystem is a rename;
+ * across filesystems it is a copy, after which the source is removed.
+ */
+
+/* Threads for file operations, started on first use */
+static int fileop_start(void)
+{
+    int i;
+
+    if (fileop_running) return 0;
+    for (i = 0; i < FILEOP_THREADS; i++) {
+        if (pthread_create(&fileop_threads[i], NULL, fileop_main,
+                           NULL) != 0) {
+            break;
+        }
+    }
+    fileop_running = i;
+    return i > 0 ? 0 : -1;
+}
+
+static void *fileop_main(void *arg)
+{
+    Job *j;
+    int err;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&fileop_lock);
+        while (1) {
+            for (j = jobs; j != NULL && __atomic_load_n(&j->state,
+                                         __ATOMIC_RELAXED) != JOB_QUEUED;
+                 j = j->next) ;
+            if (j != NULL) break;
+            pthread_cond_wait(&fileop_cond, &fileop_lock);
+        }
+        j->start_us = now_us();
+        __atomic_store_n(&j->state, JOB_RUNNING, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&fileop_lock);
+
+        err = fileop_run(j);
+        /* the job is the UI's to free once it is done */
+        j->err = err;
+        j->end_us = now_us();
+        __atomic_store_n(&j->state, JOB_DONE, __ATOMIC_RELEASE);
+        if (write(wake_pipe[1], "j", 1) < 0 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+    return NULL;
+}
+
+/* Carry out one job; returns 0 or an errno value */
+static int fileop_run(Job *j)
+{
+    char tname[NAME_MAX + 1];
+    struct stat st, dst_st;
+    size_t len = strlen(j->src);
+    int sfd = -1, dfd = -1;
+    int err = 0;
+    int n;
+
+    if (j->op == JOB_DELETE) return fileop_delete(j);
+    /* a directory cannot go inside itself */
+    if (strncmp(j->dst, j->src, len) == 0 &&
+        (j->dst[len] == '\0' || j->dst[len] == '/')) {
+        return EINVAL;
+    }
+    sfd = fileop_parent(j->src);
+    if (sfd >= 0) dfd = open(j->dst, O_RDONLY | O_DIRECTORY);
+    if (sfd < 0 || dfd < 0 || fstat(sfd, &st) != 0 ||
+        fstat(dfd, &dst_st) != 0) {
+        err = errno;
+    } else if (j->op == JOB_MOVE && st.st_dev == dst_st.st_dev &&
+               st.st_ino == dst_st.st_ino) {
+        /* already there */
+    } else {
+        /* the same name, or the first free one of name~1, name~2... */
+        snprintf(tname, sizeof(tname), "%s", j->name);
+        for (n = 1; fstatat(dfd, tname, &st, AT_SYMLINK_NOFOLLOW) == 0;
+             n++) {
+            snprintf(tname, sizeof(tname), "%s~%d", j->name, n);
+        }
+        if (j->op == JOB_MOVE && renameat(sfd, j->name, dfd, tname) == 0) {
+            __atomic_store_n(&j->total, 0, __ATOMIC_RELAXED);
+        } else if (j->op == JOB_MOVE && errno != EXDEV) {
+            err = errno;
+        } else {
+            __atomic_store_n(&j->total, fileop_measure(j, sfd, j->name),
+                             __ATOMIC_RELAXED);
+            err = fileop_copy(j, sfd, j->name, dfd, tname);
+            if (err != 0) {
+                /* no half copies are left behind */
+                fileop_remove(dfd, tname);
+            } else if (j->op == JOB_MOVE) {
+                err = fileop_remove(sfd, j->name);
+            }
+        }
+    }
+    if (sfd >= 0) close(sfd);
+    if (dfd >= 0) close(dfd);
+    return err;
+}
+
+/* Open the directory path is in; -1 with errno set on failure */
+static int fileop_parent(const char *path)
+{
+    char *parent = strdup(path);
+    int fd;
+
+    if (parent == NULL) return -1;
+    if (strrchr(parent, '/') == parent) {
+        parent[1] = '\0';
+    } else {
+        *strrchr(parent, '/') = '\0';
+    }
+    fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(parent);
+    return fd;
+}
+
+/* Bytes in the regular files at name under dfd, directories walked */
+static long long fileop_measure(Job *j, int dfd, const char *name)
+{
+    struct stat st;
+    struct dirent *de;
+    long long n = 0;
+    DIR *dir;
+    int fd;
+
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return 0;
+    if (!S_ISDIR(st.st_mode)) return S_ISREG(st.st_mode) ? st.st_size : 0;
+    fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    while ((de = readdir(dir)) != NULL &&
+           !__atomic_load_n(&j->cancel, __ATOMIC_RELAXED)) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        n += fileop_measure(j, dirfd(dir), de->d_name);
+    }
+    closedir(dir);
+    return n;
+}
+
+/*
+ * Copy sname under sfd to the new dname under dfd, directories with
+ * all they hold. Modes and times follow the source; devices and
+ * sockets are left out. Returns 0 or an errno value.
+ */
+static int fileop_copy(Job *j, int sfd, const char *sname, int dfd,
+                       const char *dname)
+{
+    char target[PATH_MAX];
+    struct timespec times[2];
+    struct stat st;
+    struct dirent *de;
+    DIR *dir;
+    ssize_t n;
+    int in, out;
+    int err = 0;
+
+    if (__atomic_load_n(&j->cancel, __ATOMIC_RELAXED)) return ECANCELED;
+    if (fstatat(sfd, sname, &st, AT_SYMLINK_NOFOLLOW) != 0) return errno;
+    if (S_ISLNK(st.st_mode)) {
+        n = readlinkat(sfd, sname, target, sizeof(target) - 1);
+        if (n < 0) return errno;
+        target[n] = '\0';
+        return symlinkat(target, dfd, dname) == 0 ? 0 : errno;
+    }
+    if (S_ISFIFO(st.st_mode)) {
+        return mkfifoat(dfd, dname, st.st_mode & 07777) == 0 ? 0 : errno;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) return 0;
+
+    if (S_ISREG(st.st_mode)) {
+        in = openat(sfd, sname, O_RDONLY | O_NOFOLLOW);
+        out = in >= 0 ? openat(dfd, dname, O_WRONLY | O_CREAT | O_EXCL,
+                               0600) : -1;
+        if (out < 0) err = errno;
+        if (err == 0) err = fileop_copy_file(j, in, out, st.st_size);
+        if (in >= 0) close(in);
+    } else {
+        in = -1;
+        out = -1;
+        dir = NULL;
+        if (mkdirat(dfd, dname, 0700) == 0) {
+            in = openat(sfd, sname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            out = openat(dfd, dname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            dir = in >= 0 && out >= 0 ? fdopendir(in) : NULL;
+        }
+        if (dir == NULL) {
+            err = errno;
+            if (in >= 0) close(in);
+        }
+        while (dir != NULL && err == 0 && (de = readdir(dir)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 ||
+                strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+            err = fileop_copy(j, in, de->d_name, out, de->d_name);
+        }
+        if (dir != NULL) closedir(dir);
+    }
+    if (out < 0) return err;
+    if (err == 0) {
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        if (fchmod(out, st.st_mode & 07777) != 0 ||
+            futimens(out, times) != 0) {
+            err = errno;
+        }
+    }
+    close(out);
+    return err;
+}
+
+/*
+ * The data of one file, from in to the empty out: a clone if the
+ * filesystem will share it, else in FILEOP_CHUNK pieces by the best
+ * means that works, counting each into the job's progress.
+ */
+static int fileop_copy_file(Job *j, int in, int out, off_t size)
+{
+    char *buf = NULL;
+    ssize_t n, w, off;
+    int how = 0;        /* copy_file_range(), sendfile(), read() */
+    int err = 0;
+
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        __atomic_add_fetch(&j->done, (long long)size, __ATOMIC_RELAXED);
+        return 0;
+    }
+#else
+    (void)size;
+#endif
+    while (1) {
+        if (__atomic_load_n(&j->cancel, __ATOMIC_RELAXED)) {
+            err = ECANCELED;
+            break;
+        }
+        n = -1;
+        errno = ENOSYS;
+        if (how == 0) {
+#ifdef HAVE_COPY_FILE_RANGE
+            n = copy_file_range(in, NULL, out, NULL, FILEOP_CHUNK, 0);
+#endif
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+                          errno == EINVAL || errno == EOPNOTSUPP)) {
+                how++;
+                continue;
+            }
+        } else if (how == 1) {
+#ifdef HAVE_SENDFILE
+            n = sendfile(out, in, NULL, FILEOP_CHUNK);
+#endif
+            if (n < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                how++;
+                continue;
+            }
+        } else {
+            if (buf == NULL && (buf = (char*)malloc(FILEOP_BUF)) == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            n = read(in, buf, FILEOP_BUF);
+            for (off = 0; off < n; off += w) {
+                w = write(out, buf + off, n - off);
+                if (w < 0 && errno == EINTR) {
+                    w = 0;
+                } else if (w < 0) {
+                    n = -1;
+                    break;
+                }
+            }
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            err = errno;
+            break;
+        }
+        if (n == 0) break;
+        __atomic_add_fetch(&j->done, (long long)n, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return err;
+}
+
+/* Remove name under dfd, and everything in it; returns 0 or an errno */
+static int fileop_remove(int dfd, const char *name)
+{
+    struct stat st;
+    struct dirent *de;
+    DIR *dir;
+    int fd;
+    int err = 0, e;
+
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return errno == ENOENT ? 0 : errno;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return unlinkat(dfd, name, 0) == 0 ? 0 : errno;
+    }
+    fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        err = errno;
+        if (fd >= 0) close(fd);
+        return err;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        e = fileop_remove(dirfd(dir), de->d_name);
+        if (err == 0) err = e;
+    }
+    closedir(dir);
+    if (err == 0 && unlinkat(dfd, name, AT_REMOVEDIR) != 0) err = errno;
+    return err;
+}
+
+/*
+ * Delete a file, or a directory with everything below it. A tree is
+ * taken apart by the indexer pool: each directory is a task that
+ * unlinks its files and queues its subdirectories, so big trees are
+ * emptied by every worker at once. A directory is removed when the
+ * last of its subdirectories is, and this thread waits for the root.
+ * The view keeps up through the directory watch as entries go.
+ */
+static int fileop_delete(Job *j)
+{
+    struct stat st;
+    IndexDir *d = NULL;
+    int pfd, fd = -1;
+    int err = 0;
+
+    pfd = fileop_parent(j->src);
+    if (pfd < 0) return errno;
+    if (fstatat(pfd, j->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        err = errno;
+    } else if (!S_ISDIR(st.st_mode)) {
+        if (unlinkat(pfd, j->name, 0) != 0) {
+            err = errno;
+        } else {
+            __atomic_add_fetch(&j->done, 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        fd = openat(pfd, j->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                    O_CLOEXEC);
+        if (fd >= 0) d = index_dir_new(NULL, "", 0, 0);
+        if (d == NULL) {
+            err = fd >= 0 ? ENOMEM : errno;
+            if (fd >= 0) close(fd);
+        }
+    }
+    if (d != NULL) {
+        d->fd = fd;
+        d->del = j;
+        if (index_push(0, d) < 0) {
+            del_fail(j, ENOMEM);
+            del_release(d);
+        }
+        pthread_mutex_lock(&fileop_lock);
+        while (!j->walked) pthread_cond_wait(&del_cond, &fileop_lock);
+        pthread_mutex_unlock(&fileop_lock);
+
+        err = __atomic_load_n(&j->fail, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&j->cancel, __ATOMIC_RELAXED)) err = ECANCELED;
+        if (err == 0 && unlinkat(pfd, j->name, AT_REMOVEDIR) != 0) {
+            err = errno;
+        }
+        if (err == 0) __atomic_add_fetch(&j->done, 1, __ATOMIC_RELAXED);
+    }
+    close(pfd);
+    return err;
+}
+
+/* Keep the first error of a delete; later ones tend to follow from it */
+static void del_fail(Job *j, int err)
+{
+    int none = 0;
+
+    __atomic_compare_exchange_n(&j->fail, &none, err, 0, __ATOMIC_ACQ_REL,
+                                __ATOMIC_RELAXED);
+}
+
+/* Pool task: unlink the files of one directory, queue its subdirectories */
+static void del_walk(int w, IndexDir *d)
+{
+    Job *j = d->del;
+    DIR *dir = NULL;
+    struct dirent *de;
+    struct stat st;
+    IndexDir *child;
+    long long n = 0;
+    int isdir;
+    int fd = -1;
+
+    if (d->parent != NULL) {
+        d->fd = openat(d->parent->fd, d->path, O_RDONLY | O_DIRECTORY |
+                       O_NOFOLLOW | O_CLOEXEC);
+        if (d->fd < 0 && errno != ENOENT) del_fail(j, errno);
+    }
+    if (d->fd >= 0 && !__atomic_load_n(&j->cancel, __ATOMIC_RELAXED)) {
+        fd = dup(d->fd);
+    }
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0) close(fd);
+        del_release(d);
+        return;
+    }
+
+    while (!__atomic_load_n(&j->cancel, __ATOMIC_RELAXED) &&
+           (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0) continue;
+        if (strcmp(de->d_name, "..") == 0) continue;
+#ifdef DT_UNKNOWN
+        isdir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN)
+#endif
+            isdir = fstatat(d->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                    && S_ISDIR(st.st_mode);
+        if (isdir) {
+            /* it holds a reference to us until it is gone */
+            child = index_dir_new(d, de->d_name, strlen(de->d_name), 0);
+            if (child == NULL) {
+                del_fail(j, ENOMEM);
+                continue;
+            }
+            __atomic_add_fetch(&d->refs, 1, __ATOMIC_ACQ_REL);
+            if (index_push(w, child) < 0) {
+                del_fail(j, ENOMEM);
+                __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL);
+                free(child);
+            }
+        } else if (unlinkat(d->fd, de->d_name, 0) == 0) {
+            n++;
+        } else if (errno != ENOENT) {
+            del_fail(j, errno);
+        }
+        if (n == SCAN_BATCH) {
+            __atomic_add_fetch(&j->done, n, __ATOMIC_RELAXED);
+            n = 0;
+        }
+    }
+    __atomic_add_fetch(&j->done, n, __ATOMIC_RELAXED);
+    closedir(dir);
+    del_release(d);
+}
+
+/*
+ * Drop a reference to a directory being deleted. The last one goes
+ * once it is listed and its subdirectories are gone: it is removed
+ * from its parent, whose reference is dropped in turn, and the root's
+ * wakes fileop_delete().
+ */
+static void del_release(IndexDir *d)
+{
+    IndexDir *parent;
+    Job *j = d->del;
+
+    while (d != NULL &&
+           __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        parent = d->parent;
+        if (d->fd >= 0) close(d->fd);
+        if (parent == NULL) {
+            pthread_mutex_lock(&fileop_lock);
+            j->walked = 1;
+            pthread_cond_broadcast(&del_cond);
+            pthread_mutex_unlock(&fileop_lock);
+        } else if (unlinkat(parent->fd, d->path, AT_REMOVEDIR) == 0) {
+            __atomic_add_fetch(&j->done, 1, __ATOMIC_RELAXED);
+        } else if (errno != ENOENT &&
+                   !__atomic_load_n(&j->cancel, __ATOMIC_RELAXED)) {
+            del_fail(j, errno);
+        }
+        free(d);
+        d = parent;
+    }
+}
+
+/*
+ * Queue a copy or move of the path src into the directory dst, or with
+ * dst NULL a delete of src
+ */
+static void job_add(int op, const char *src, const char *dst)
+{
+    Job *j, **p;
+
+    j = (Job*)calloc(1, sizeof(Job));
+    if (j != NULL) {
+        j->src = strdup(src);
+        j->dst = dst != NULL ? strdup(dst) : NULL;
+    }
+    if (j == NULL || j->src == NULL || (dst != NULL && j->dst == NULL) ||
+        fileop_start() != 0 || (op == JOB_DELETE && index_start() != 0)) {
+        status_error("%s: could not queue", src);
+        if (j != NULL) {
+            free(j->src);
+            free(j->dst);
+            free(j);
+        }
+        return;
+    }
+    j->op = op;
+    j->name = strrchr(j->src, '/') + 1;
+    j->total = -1;
+
+    pthread_mutex_lock(&fileop_lock);
+    for (p = &jobs; *p != NULL; p = &(*p)->next) ;
+    *p = j;
+    pthread_cond_signal(&fileop_cond);
+    pthread_mutex_unlock(&fileop_lock);
+    njobs++;
+    damage_rect(JOBS_X, JOBS_Y, JOBS_W, JOBS_H);
+}
+
+/* Ctrl-K: queued jobs are dropped, running ones stop at the next piece */
+static void jobs_cancel(void)
+{
+    Job *j;
+
+    pthread_mutex_lock(&fileop_lock);
+    for (j = jobs; j != NULL; j = j->next) {
+        __atomic_store_n(&j->cancel, 1, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&j->state, __ATOMIC_RELAXED) == JOB_QUEUED) {
+            j->err = ECANCELED;
+            j->end_us = now_us();
+            __atomic_store_n(&j->state, JOB_DONE, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&fileop_lock);
+    damage_rect(JOBS_X, JOBS_Y, JOBS_W, JOBS_H);
+}
+
+/*
+ * Called by the main loop: while there are jobs, redraw the overlay
+ * every SIZE_TICK_MS, and drop jobs that finished JOB_LINGER_MS ago.
+ * Returns the milliseconds to the next tick, or -1 if there are none.
+ */
+static int jobs_tick(const struct timespec *now)
+{
+    Job *j, **p;
+    long long t;
+    long ms;
+
+    if (njobs == 0) return -1;
+    ms = elapsed_ms(&jobs_last_tick, now);
+    if (ms < SIZE_TICK_MS) return SIZE_TICK_MS - ms;
+    jobs_last_tick = *now;
+
+    t = now_us();
+    pthread_mutex_lock(&fileop_lock);
+    p = &jobs;
+    while ((j = *p) != NULL) {
+        if (__atomic_load_n(&j->state, __ATOMIC_ACQUIRE) == JOB_DONE &&
+            t - j->end_us > JOB_LINGER_MS * 1000LL) {
+            *p = j->next;
+            free(j->src);
+            free(j->dst);
+            free(j);
+            njobs--;
+        } else {
+            p = &j->next;
+        }
+    }
+    pthread_mutex_unlock(&fileop_lock);
+    /* the rows under it come back once the last one has gone */
+    damage_rect(JOBS_X, JOBS_Y, JOBS_W, JOBS_H);
+    return njobs > 0 ? SIZE_TICK_MS : -1;
+}
+
+/* A job finished; say so in the status line if it failed */
+static void jobs_collect(void)
+{
+    Job *j;
+
+    pthread_mutex_lock(&fileop_lock);
+    for (j = jobs; j != NULL; j = j->next) {
+        if (j->told ||
+            __atomic_load_n(&j->state, __ATOMIC_ACQUIRE) != JOB_DONE) {
+            continue;
+        }
+        j->told = 1;
+        if (j->err != 0 && j->err != ECANCELED) {
+            status_error("%s %s: %s", job_ops[j->op], j->name,
+                         strerror(j->err));
+        }
+    }
+    pthread_mutex_unlock(&fileop_lock);
+    damage_rect(JOBS_X, JOBS_Y, JOBS_W, JOBS_H);
+}
+
+/* Full path of the selected entry, malloc'ed; NULL for none or .. */
+static char *selection_path(void)
+{
+    if (selected < 0 || is_dotdot(view[selected].idx)) return NULL;
+    return entry_path(view[selected].idx);
+}
+
+/* Ctrl-C, Ctrl-X: remember the selection for Ctrl-Y to copy or move */
+static void clip_mark(int op)
+{
+    char *path = selection_path();
+
+    if (path == NULL) return;
+    free(clip_path);
+    clip_path = path;
+    clip_op = op;
+    status_set("%s %s: Ctrl-Y here", job_ops[op], strrchr(path, '/') + 1);
+}
+
+/* Delete: ask first; the next key answers, see handle_event() */
+static void delete_ask(void)
+{
+    free(confirm_path);
+    confirm_path = selection_path();
+    if (confirm_path == NULL) return;
+    status_set("delete %s%s? y to confirm", strrchr(confirm_path, '/') + 1,
+               entries[view[selected].idx].flags & E_DIR
+               ? " and everything in it" : "");
+}
+
+/* Convert window Y to a row of the view, through the scroll offset */
+static int y_to_index(int y)
+{
+    int rel = y - LIST_Y;
+    if (rel < 0 || rel >= LIST_ROWS * LINE_HEIGHT) return -1;
+    return scroll_top + rel / LINE_HEIGHT;
+}
+
+/* Handle X events */
+static void handle_event(XEvent *ev)
+{
+    int idx;
+    Time ct;
+    KeySym ks;
+    char buf[16];
+    int len;
+    int i;
+    XRectangle r;
+    
+    if (ev->type == Expose) {
+        /* backbuf is intact; copy back just what was exposed */
+        r.x = ev->xexpose.x;
+        r.y = ev->xexpose.y;
+        r.width = ev->xexpose.width;
+        r.height = ev->xexpose.height;
+        XUnionRectWithRegion(&r, present, present);
+    } else if (ev->type == ButtonPress && ev->xbutton.button == Button4) {
+        scroll_by(-WHEEL_STEP);
+    } else if (ev->type == ButtonPress && ev->xbutton.button == Button5) {
+        scroll_by(WHEEL_STEP);
+    } else if (ev->type == ButtonPress) {
+        idx = ev->xbutton.x < LIST_X + LIST_W ? y_to_index(ev->xbutton.y)
+                                               : -1;
+        ct = ev->xbutton.time;
+        if (idx >= 0 && idx < nview) {
+            select_index(idx);
+            /* detect double click: same index and within 400 ms */
+            if (last_click_index == idx && last_click_time != 0 && 
+                (ct - last_click_time) <= 400) {
+                open_entry(view[idx].idx);
+                last_click_time = 0;
+                last_click_index = -1;
+            } else {
+                last_click_time = ct;
+                last_click_index = idx;
+            }
+        }
+    } else if (ev->type == KeyPress) {
+        len = XLookupString(&ev->xkey, buf, sizeof(buf), &ks, NULL);
+        /* Shift and the like on their own are not keys to answer */
+        if (len == 0 && IsModifierKey(ks)) return;
+        if (status_msg[0] != '\0') {
+            status_msg[0] = '\0';
+            damage_rect(0, LIST_Y + LIST_H, WINDOW_W,
+                        WINDOW_H - LIST_Y - LIST_H);
+        }
+        if (confirm_path != NULL) {
+            /* the key after Delete: y goes ahead, anything else does not */
+            if (len > 0 && FOLD(buf[0]) == 'y') {
+                job_add(JOB_DELETE, confirm_path, NULL);
+            }
+            free(confirm_path);
+            confirm_path = NULL;
+            return;
+        }
+        /* printable keys go to the filter, commands are on control keys */
+        if (len > 0) {
+            if (buf[0] == 0x11) {
+                /* Ctrl-Q: quit */
+                if (trace_path || stats_path) trace_dump();
+                XCloseDisplay(dpy);
+                exit(0);
+            } else if (buf[0] == 0x10) {
+                /* Ctrl-P: performance overlay */
+                hud_on = !hud_on;
+                if (hud_on) hud_dirty = 1; else damage_all();
+            } else if (buf[0] == 0x16) {
+                /* Ctrl-V: preview pane */
+                preview_on = !preview_on;
+                preview_sel = -1;
+                damage_all();
+            } else if (buf[0] == 0x14) {
+                /* Ctrl-T: write the span statistics and trace */
+                trace_dump();
+            } else if (buf[0] == 0x03 || buf[0] == 0x18) {
+                /* Ctrl-C, Ctrl-X: mark the selection to copy or move */
+                clip_mark(buf[0] == 0x03 ? JOB_COPY : JOB_MOVE);
+            } else if (buf[0] == 0x19) {
+                /* Ctrl-Y: copy or move what was marked to here */
+                if (clip_path != NULL) {
+                    job_add(clip_op, clip_path, cwd_path());
+                    if (clip_op == JOB_MOVE) {
+                        free(clip_path);
+                        clip_path = NULL;
+                    }
+                }
+            } else if (buf[0] == 0x0b) {
+                /* Ctrl-K: cancel the copies, moves and deletes */
+                jobs_cancel();
+            } else if (buf[0] == '\n' || buf[0] == '\r') {
+                if (selected >= 0) open_entry(view[selected].idx);
+            } else if (buf[0] == 0x13) {
+                /* Ctrl-S: next sort order */
+                sort_mode = (sort_mode + 1) % SORT_MODES;
+                view_resort();
+            } else if (buf[0] == 0x12) {
+                /* Ctrl-R: reverse the order */
+                sort_reverse = !sort_reverse;
+                view_resort();
+            } else if (buf[0] == '\t') {
+                /* substring or fuzzy matching */
+                filter_fuzzy = !filter_fuzzy;
+                if (filter_len > 0) filter_update(0);
+            } else if (buf[0] == 0x07) {
+                /* Ctrl-G: go to any file below the directory */
+                if (goto_mode) goto_leave(0); else goto_enter();
+            } else if (buf[0] == 0x1b) {
+                if (filter_len > 0) {
+                    filter_len = 0;
+                    filter_update(0);
+                } else if (goto_mode) {
+                    goto_leave(0);
+                }
+            } else if (ks == XK_Delete || ks == XK_KP_Delete) {
+                delete_ask();
+            } else if (buf[0] == '\b' || buf[0] == 0x7f) {
+                if (filter_len > 0) {
+                    filter_len--;
+                    filter_update(0);
+                }
+            } else if ((unsigned char)buf[0] >= 0x20) {
+                for (i = 0; i < len && filter_len < FILTER_MAX; i++) {
+                    filter[filter_len++] = FOLD((unsigned char)buf[i]);
+                }
+                filter[filter_len] = '\0';
+                filter_update(1);
+            }
+        } else {
+            /* arrow and paging keys */
+            if (ks == XK_Up) {
+                select_index(selected > 0 ? selected - 1 : 0);
+            } else if (ks == XK_Down) {
+                select_index(selected + 1);
+            } else if (ks == XK_Page_Up) {
+                select_index(selected - (LIST_ROWS - 1));
+            } else if (ks == XK_Page_Down) {
+                select_index(selected < 0 ? LIST_ROWS - 1
+                                          : selected + LIST_ROWS - 1);
+            } else if (ks == XK_Home) {
+                select_index(0);
+            } else if (ks == XK_End) {
+                select_index(nview - 1);
+            }
+        }
+    }
+}
+
+/* Milliseconds from a to b */
+static long elapsed_ms(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000 +
+           (b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+/*
+ * Latency spans. Each kind of work on the UI thread is timed into a
+ * histogram of log2 microsecond buckets; with XFM_TRACE set every span
+ * is also kept, the last TRACE_MAX of them, for a Chrome trace. Ctrl-T
+ * writes both files, and so does quitting when either variable is set.
+ */
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Close a span of kind span that began at start (from now_us()) */
+static void span_end(int span, long long start)
+{
+    long long end = now_us();
+    long long us = end - start;
+    Hist *h = &span_hist[span];
+    TraceEv *t;
+    int b = 0;
+
+    while (b < HIST_BUCKETS - 1 && (us >> (b + 1)) != 0) b++;
+    h->b[b]++;
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us) h->max_us = us;
+    /* drawing the HUD must not be a reason to draw it again */
+    if (span != SPAN_DRAW) hud_dirty = hud_on;
+
+    if (trace == NULL) return;
+    t = &trace[ntrace++ % TRACE_MAX];
+    t->span = span;
+    t->start_us = start;
+    t->dur_us = us;
+}
+
+/* Percentile p in microseconds, as the upper bound of its bucket */
+static long long hist_pct(const Hist *h, int p)
+{
+    unsigned long want = (h->count * p + 99) / 100;
+    unsigned long seen = 0;
+    int b;
+
+    if (want == 0) return 0;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->b[b];
+        if (seen >= want) break;
+    }
+    if (b == HIST_BUCKETS - 1 || (2LL << b) - 1 > h->max_us) return h->max_us;
+    return (2LL << b) - 1;
+}
+
+/* Utility: set the stats and trace files from env */
+static void setup_trace(void)
+{
+    char *env = getenv("XFM_TRACE");
+
+    if (env && env[0] != '\0') {
+        trace_path = env;
+        trace = (TraceEv*)malloc(sizeof(TraceEv) * TRACE_MAX);
+    }
+    env = getenv("XFM_STATS");
+    if (env && env[0] != '\0') stats_path = env;
+    trace_base = now_us();
+}
+
+/* Write the histograms as JSON, and the trace if one is kept */
+static void trace_dump(void)
+{
+    FILE *f;
+    Hist *h;
+    unsigned long i, first;
+    int s, b;
+
+    f = fopen(stats_path ? stats_path : DEFAULT_STATS, "w");
+    if (f == NULL) {
+        perror("stats");
+        return;
+    }
+    fprintf(f, "{\n  \"spans\": [");
+    for (s = 0; s < SPANS; s++) {
+        h = &span_hist[s];
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"count\": %lu, "
+                "\"mean_us\": %lld, \"p50_us\": %lld, \"p90_us\": %lld, "
+                "\"p99_us\": %lld, \"max_us\": %lld, \"buckets\": [",
+                s ? "," : "", span_names[s], h->count,
+                h->count ? h->sum_us / (long long)h->count : 0,
+                hist_pct(h, 50), hist_pct(h, 90), hist_pct(h, 99), h->max_us);
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            fprintf(f, "%s%lu", b ? ", " : "", h->b[b]);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+
+    if (trace == NULL) return;
+    f = fopen(trace_path, "w");
+    if (f == NULL) {
+        perror("trace");
+        return;
+    }
+    /* oldest first once the ring has wrapped */
+    first = ntrace > TRACE_MAX ? ntrace - TRACE_MAX : 0;
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (i = first; i < ntrace; i++) {
+        fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                "\"tid\": 1, \"ts\": %lld, \"dur\": %lld}",
+                i > first ? "," : "", span_names[trace[i % TRACE_MAX].span],
+                trace[i % TRACE_MAX].start_us - trace_base,
+                trace[i % TRACE_MAX].dur_us);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+/* Only wake the main loop; launch_reap() does the reaping there */
+static void sigchld_handler(int sig)
+{
+    int saved = errno;
+
+    (void)sig;
+    if (write(wake_pipe[1], "c", 1) < 0) {
+        /* full: a wake-up is already pending */
+    }
+    errno = saved;
+}
+
+#ifndef XFM_NO_MAIN   /* bench.cpp includes this file for its internals */
+int main(int argc, char **argv)
+{
+    XEvent ev;
+    unsigned long valuemask = 0;
+    XGCValues values;
+    struct pollfd pfd[3];
+    struct timespec now, last_frame;
+    int timeout;
+    int wait;
+    char *start;
+
+    setup_viewer();
+    setup_cache();
+    setup_trace();
+
+    /* read initial directory in the background */
+    scan_start();
+    watch_start();
+    /* getcwd() allocates as long a path as it has to; "." if it fails */
+    start = getcwd(NULL, 0);
+    nav_open(start != NULL ? start : ".");
+    free(start);
+
+    /* X init */
+    dpy = XOpenDisplay(NULL);
+    if (!dpy) {
+        fprintf(stderr, "Unable to open X display.\n");
+        return 1;
+    }
+    screen_num = DefaultScreen(dpy);
+    damage = XCreateRegion();
+    present = XCreateRegion();
+    black_pixel = BlackPixel(dpy, screen_num);
+    white_pixel = WhitePixel(dpy, screen_num);
+
+    win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen_num), 
+                             0, 0, WINDOW_W, WINDOW_H, 1, 
+                             black_pixel, white_pixel);
+    XSelectInput(dpy, win, ExposureMask | ButtonPressMask | KeyPressMask);
+    XStoreName(dpy, win, "minix_xfm");
+    XMapWindow(dpy, win);
+
+    fontinfo = XLoadQueryFont(dpy, "fixed");
+    if (!fontinfo) {
+        fontinfo = XLoadQueryFont(dpy, "6x13");
+    }
+    if (!fontinfo) {
+        fprintf(stderr, "Warning: couldn't load font\n");
+        /* Continue with default font */
+        fontinfo = XQueryFont(dpy, XGContextFromGC(DefaultGC(dpy, screen_num)));
+    }
+
+    /* copies from backbuf never need GraphicsExpose */
+    values.graphics_exposures = False;
+    valuemask |= GCGraphicsExposures;
+    gc = XCreateGC(dpy, win, valuemask, &values);
+    if (fontinfo) {
+        XSetFont(dpy, gc, fontinfo->fid);
+    }
+
+    /* back buffer the list is rendered into */
+    backbuf = XCreatePixmap(dpy, win, WINDOW_W, WINDOW_H,
+                            DefaultDepth(dpy, screen_num));
+    damage_all();
+    render_damage();
+
+    /* signal handler for children */
+    signal(SIGCHLD, sigchld_handler);
+
+    /*
+     * main loop: apply every queued X event and scanner batch, then
+     * render at most one frame for the lot, no more than one per
+     * FRAME_MS. poll() waits on the X connection, the wake-up pipe and
+     * the directory watch, or until the next frame or event burst is due.
+     * The watch is left alone while a scan runs or a burst is gathering.
+     */
+    pfd[0].fd = ConnectionNumber(dpy);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = wake_pipe[0];
+    pfd[1].events = POLLIN;
+    pfd[2].events = POLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &last_frame);
+    while (1) {
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            if (input_since < 0 &&
+                (ev.type == KeyPress || ev.type == ButtonPress)) {
+                input_since = now_us();
+            }
+            handle_event(&ev);
+        }
+        /* input that changed nothing has no frame to wait for */
+        if (input_since >= 0 && !draw_pending()) input_since = -1;
+
+        timeout = -1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (watch_armed) {
+            wait = watch_timeout(&now);
+            if (wait == 0) {
+                watch_apply();
+            } else {
+                timeout = wait;
+            }
+        }
+        wait = size_tick(&now);
+        if (wait >= 0 && (timeout < 0 || wait < timeout)) {
+            timeout = wait;
+        }
+        wait = jobs_tick(&now);
+        if (wait >= 0 && (timeout < 0 || wait < timeout)) {
+            timeout = wait;
+        }
+        wait = prefetch_timeout(&now);
+        if (wait >= 0 && (timeout < 0 || wait < timeout)) {
+            timeout = wait;
+        }
+        wait = preview_timeout(&now);
+        if (wait >= 0 && (timeout < 0 || wait < timeout)) {
+            timeout = wait;
+        }
+        if (draw_pending()) {
+            wait = FRAME_MS - elapsed_ms(&last_frame, &now);
+            if (wait <= 0) {
+                draw_list();
+                last_frame = now;
+            } else if (timeout < 0 || wait < timeout) {
+                timeout = wait;
+            }
+        }
+        XFlush(dpy);
+
+        pfd[2].fd = (scanning || watch_armed) ? -1 : watch_fd;
+        if (poll(pfd, 3, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (pfd[1].revents & POLLIN) {
+            scan_collect();
+            index_collect();
+            size_collect();
+            prefetch_collect();
+            preview_collect();
+            sniff_collect();
+            jobs_collect();
+            launch_reap();
+        }
+        if (pfd[2].revents & POLLIN) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            watch_timeout(&now);
+        }
+    }
+
+    /* cleanup (unreachable) */
+    XFreeGC(dpy, gc);
+    XCloseDisplay(dpy);
+    return 0;
+}
+#endif /* XFM_NO_MAIN */
@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -20,10 +21,11 @@
 #define WINDOW_H 400
 #define LINE_HEIGHT 16
 #define MARGIN 5
+#define LIST_ROWS ((WINDOW_H - 2*MARGIN) / LINE_HEIGHT)
 
 /* Simple entry structure */
 typedef struct Entry {
-    char name[256];
+    unsigned int name_off;  /* offset of the name in names[] */
     int is_dir;
 } Entry;
 
@@ -32,18 +34,64 @@ static Display *dpy;
 static Window win;
 static GC gc;
 static XFontStruct *fontinfo;
+static Pixmap backbuf;  /* the list is drawn here, then copied to win */
 
-static Entry entries[1000];
+static Entry *entries = NULL;
 static int nentries = 0;
+static int entries_cap = 0;
+static char *names = NULL;      /* all names, back to back */
+static size_t names_len = 0;
+static size_t names_cap = 0;
+static int top = 0;     /* first visible entry */
+static int need_redraw = 0;
 static char cwd[1024];
 
+/* Name of entry i, NUL-terminated inside names[] */
+static const char *entry_name(int i)
+{
+    return names + entries[i].name_off;
+}
+
+/*
+ * Make room for entry nentries and copy its name into the arena.
+ * Both arrays grow by doubling, so memory follows the real number of
+ * entries and the real length of their names.
+ */
+static int store_name(const char *name)
+{
+    size_t len = strlen(name) + 1;
+    size_t ncap;
+    int ecap;
+    Entry *etmp;
+    char *ntmp;
+
+    if (nentries == entries_cap) {
+        ecap = entries_cap ? entries_cap * 2 : 256;
+        etmp = (Entry*)realloc(entries, sizeof(Entry) * ecap);
+        if (!etmp) return -1;
+        entries = etmp;
+        entries_cap = ecap;
+    }
+    if (names_len + len > names_cap) {
+        ncap = names_cap ? names_cap : 4096;
+        while (names_len + len > ncap) ncap *= 2;
+        ntmp = (char*)realloc(names, ncap);
+        if (!ntmp) return -1;
+        names = ntmp;
+        names_cap = ncap;
+    }
+    entries[nentries].name_off = names_len;
+    memcpy(names + names_len, name, len);
+    names_len += len;
+    return 0;
+}
+
 /* Read directory contents */
 static void read_dir(const char *path)
 {
     DIR *d;
     struct dirent *de;
     struct stat st;
-    char full[1024];
     int i = 0;
 
     d = opendir(path);
@@ -53,33 +101,40 @@ static void read_dir(const char *path)
     }
 
     nentries = 0;
+    names_len = 0;
     
     /* Add .. for navigation */
     if (strcmp(path, "/") != 0) {
-        strcpy(entries[nentries].name, "..");
+        if (store_name("..") < 0) {
+            closedir(d);
+            return;
+        }
         entries[nentries].is_dir = 1;
         nentries++;
     }
 
-    while ((de = readdir(d)) != NULL && nentries < 1000) {
+    while ((de = readdir(d)) != NULL) {
         if (strcmp(de->d_name, ".") == 0) continue;
         
-        strncpy(entries[nentries].name, de->d_name, 255);
+        if (store_name(de->d_name) < 0)
+            break; /* OOM */
         
-        /* Build full path */
-        if (path[strlen(path)-1] == '/')
-            sprintf(full, "%s%s", path, de->d_name);
-        else
-            sprintf(full, "%s/%s", path, de->d_name);
-
-        if (stat(full, &st) == 0 && S_ISDIR(st.st_mode))
+        /* d_type is enough unless it is a symlink or unknown */
+#ifdef DT_UNKNOWN
+        if (de->d_type == DT_DIR)
             entries[nentries].is_dir = 1;
-        else
+        else if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
             entries[nentries].is_dir = 0;
+        else
+#endif
+            entries[nentries].is_dir =
+                fstatat(dirfd(d), de->d_name, &st, 0) == 0 &&
+                S_ISDIR(st.st_mode);
 
         nentries++;
     }
     closedir(d);
+    top = 0;
 }
 
 /* Draw the file list */
@@ -89,19 +144,23 @@ static void draw_list(void)
     char display[300];
     int y;
 
-    /* Clear window */
-    XClearWindow(dpy, win);
+    /* Clear back buffer */
+    XSetForeground(dpy, gc, WhitePixel(dpy, 0));
+    XFillRectangle(dpy, backbuf, gc, 0, 0, WINDOW_W, WINDOW_H);
+    XSetForeground(dpy, gc, BlackPixel(dpy, 0));
 
-    for (i = 0; i < nentries; i++) {
-        y = MARGIN + i * LINE_HEIGHT + fontinfo->ascent;
+    for (i = top; i < nentries && i < top + LIST_ROWS; i++) {
+        y = MARGIN + (i - top) * LINE_HEIGHT + fontinfo->ascent;
         
         if (entries[i].is_dir)
-            sprintf(display, "[DIR] %s", entries[i].name);
+            sprintf(display, "[DIR] %s", entry_name(i));
         else
-            sprintf(display, "      %s", entries[i].name);
+            sprintf(display, "      %s", entry_name(i));
             
-        XDrawString(dpy, win, gc, MARGIN, y, display, strlen(display));
+        XDrawString(dpy, backbuf, gc, MARGIN, y, display, strlen(display));
     }
+
+    XCopyArea(dpy, backbuf, win, gc, 0, 0, WINDOW_W, WINDOW_H, 0, 0);
 }
 
 /* Open file or directory */
@@ -113,7 +172,7 @@ static void open_entry(int idx)
     if (idx < 0 || idx >= nentries) return;
 
     if (entries[idx].is_dir) {
-        if (strcmp(entries[idx].name, "..") == 0) {
+        if (strcmp(entry_name(idx), "..") == 0) {
             p = strrchr(cwd, '/');
             if (!p || p == cwd)
                 strcpy(cwd, "/");
@@ -121,22 +180,22 @@ static void open_entry(int idx)
                 *p = '\0';
         } else {
             if (strcmp(cwd, "/") == 0)
-                sprintf(newpath, "/%s", entries[idx].name);
+                sprintf(newpath, "/%s", entry_name(idx));
             else
-                sprintf(newpath, "%s/%s", cwd, entries[idx].name);
+                sprintf(newpath, "%s/%s", cwd, entry_name(idx));
             strcpy(cwd, newpath);
         }
         read_dir(cwd);
-        draw_list();
+        need_redraw = 1;
     } else {
         /* Simple file opening with xterm */
         int pid = fork();
         if (pid == 0) {
             char filepath[1024];
             if (strcmp(cwd, "/") == 0)
-                sprintf(filepath, "/%s", entries[idx].name);
+                sprintf(filepath, "/%s", entry_name(idx));
             else
-                sprintf(filepath, "%s/%s", cwd, entries[idx].name);
+                sprintf(filepath, "%s/%s", cwd, entry_name(idx));
                 
             execlp("xterm", "xterm", "-e", "vi", filepath, NULL);
             _exit(1);
@@ -144,11 +203,23 @@ static void open_entry(int idx)
     }
 }
 
+/* Mouse wheel scrolling */
+static void scroll_by(int delta)
+{
+    top += delta;
+    if (top > nentries - LIST_ROWS)
+        top = nentries - LIST_ROWS;
+    if (top < 0)
+        top = 0;
+    need_redraw = 1;
+}
+
 /* Handle mouse clicks */
 static void handle_click(int y)
 {
-    int idx = (y - MARGIN) / LINE_HEIGHT;
-    if (idx >= 0 && idx < nentries) {
+    int row = (y - MARGIN) / LINE_HEIGHT;
+    int idx = top + row;
+    if (y >= MARGIN && row < LIST_ROWS && idx < nentries) {
         open_entry(idx);
     }
 }
@@ -183,18 +254,37 @@ int main(int argc, char **argv)
     gc = XCreateGC(dpy, win, 0, NULL);
     if (fontinfo)
         XSetFont(dpy, gc, fontinfo->fid);
+    XSetGraphicsExposures(dpy, gc, False);
+
+    backbuf = XCreatePixmap(dpy, win, WINDOW_W, WINDOW_H,
+                            DefaultDepth(dpy, 0));
 
     /* Read initial directory */
     read_dir(cwd);
+    draw_list();
 
-    /* Main event loop */
+    /* Main event loop: drain the queue, then draw once */
     while (1) {
         XNextEvent(dpy, &ev);
         if (ev.type == Expose) {
-            draw_list();
+            /* Back buffer is current, just copy the exposed part */
+            XCopyArea(dpy, backbuf, win, gc,
+                      ev.xexpose.x, ev.xexpose.y,
+                      ev.xexpose.width, ev.xexpose.height,
+                      ev.xexpose.x, ev.xexpose.y);
+        } else if (ev.type == ButtonPress && ev.xbutton.button == Button4) {
+            scroll_by(-3);
+        } else if (ev.type == ButtonPress && ev.xbutton.button == Button5) {
+            scroll_by(3);
         } else if (ev.type == ButtonPress) {
             handle_click(ev.xbutton.y);
         }
+        if (XPending(dpy))
+            continue;
+        if (need_redraw) {
+            draw_list();
+            need_redraw = 0;
+        }
     }
 
     return 0;
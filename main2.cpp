@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -21,9 +22,10 @@
 #define WINDOW_H 400
 #define LINE_HEIGHT 16
 #define MARGIN 5
+#define LIST_ROWS ((WINDOW_H - 2*MARGIN - LINE_HEIGHT) / LINE_HEIGHT)
 
 typedef struct Entry {
-    char name[256];
+    unsigned int name_off;  /* offset of the name in names[] */
     int is_dir;
 } Entry;
 
@@ -31,19 +33,65 @@ static Display *dpy;
 static Window win;
 static GC gc;
 static XFontStruct *fontinfo;
+static Pixmap backbuf;  /* everything is drawn here, then copied to win */
 static unsigned long black_pixel, white_pixel;
 
-static Entry entries[1000];
+static Entry *entries = NULL;
 static int nentries = 0;
+static int entries_cap = 0;
+static char *names = NULL;      /* all names, back to back */
+static size_t names_len = 0;
+static size_t names_cap = 0;
 static int selected = 0;
+static int top = 0;     /* first visible entry */
+static int dirty_y0 = 0, dirty_y1 = 0;  /* band to redraw after this batch */
 static char cwd[1024];
 
+/* Name of entry i, NUL-terminated inside names[] */
+static const char *entry_name(int i)
+{
+    return names + entries[i].name_off;
+}
+
+/*
+ * Make room for entry nentries and copy its name into the arena.
+ * Both arrays grow by doubling, so memory follows the real number of
+ * entries and the real length of their names.
+ */
+static int store_name(const char *name)
+{
+    size_t len = strlen(name) + 1;
+    size_t ncap;
+    int ecap;
+    Entry *etmp;
+    char *ntmp;
+
+    if (nentries == entries_cap) {
+        ecap = entries_cap ? entries_cap * 2 : 256;
+        etmp = (Entry*)realloc(entries, sizeof(Entry) * ecap);
+        if (!etmp) return -1;
+        entries = etmp;
+        entries_cap = ecap;
+    }
+    if (names_len + len > names_cap) {
+        ncap = names_cap ? names_cap : 4096;
+        while (names_len + len > ncap) ncap *= 2;
+        ntmp = (char*)realloc(names, ncap);
+        if (!ntmp) return -1;
+        names = ntmp;
+        names_cap = ncap;
+    }
+    entries[nentries].name_off = names_len;
+    memcpy(names + names_len, name, len);
+    names_len += len;
+    return 0;
+}
+
 static void read_dir(const char *path)
 {
     DIR *d;
     struct dirent *de;
     struct stat st;
-    char full[1024];
 
     d = opendir(path);
     if (!d) {
@@ -52,68 +100,134 @@ static void read_dir(const char *path)
     }
 
     nentries = 0;
+    names_len = 0;
     
     /* Add .. for navigation */
     if (strcmp(path, "/") != 0) {
-        strcpy(entries[nentries].name, "..");
+        if (store_name("..") < 0) {
+            closedir(d);
+            return;
+        }
         entries[nentries].is_dir = 1;
         nentries++;
     }
 
-    while ((de = readdir(d)) != NULL && nentries < 1000) {
+    while ((de = readdir(d)) != NULL) {
         if (strcmp(de->d_name, ".") == 0) continue;
         
-        strncpy(entries[nentries].name, de->d_name, 255);
+        if (store_name(de->d_name) < 0)
+            break; /* OOM */
         
-        if (path[strlen(path)-1] == '/')
-            sprintf(full, "%s%s", path, de->d_name);
-        else
-            sprintf(full, "%s/%s", path, de->d_name);
-
-        if (stat(full, &st) == 0 && S_ISDIR(st.st_mode))
+        /* d_type is enough unless it is a symlink or unknown */
+#ifdef DT_UNKNOWN
+        if (de->d_type == DT_DIR)
             entries[nentries].is_dir = 1;
-        else
+        else if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
             entries[nentries].is_dir = 0;
+        else
+#endif
+            entries[nentries].is_dir =
+                fstatat(dirfd(d), de->d_name, &st, 0) == 0 &&
+                S_ISDIR(st.st_mode);
 
         nentries++;
     }
     closedir(d);
     
     selected = 0; /* Reset selection */
+    top = 0;
 }
 
-static void draw_list(void)
+/* Keep top within range and the selection on screen */
+static void scroll_to_selected(void)
+{
+    if (selected < top)
+        top = selected;
+    if (selected >= top + LIST_ROWS)
+        top = selected - LIST_ROWS + 1;
+    if (top > nentries - LIST_ROWS)
+        top = nentries - LIST_ROWS;
+    if (top < 0)
+        top = 0;
+}
+
+/* Draw one visible row, background included */
+static void draw_row(int i)
 {
-    int i;
     char display[300];
-    int y;
+    int y = MARGIN + (i - top) * LINE_HEIGHT;
+
+    /* Draw selection highlight */
+    XSetForeground(dpy, gc, i == selected ? 0xCCCCCC : white_pixel);
+    XFillRectangle(dpy, backbuf, gc, 0, y, WINDOW_W, LINE_HEIGHT);
+    XSetForeground(dpy, gc, black_pixel);
+
+    if (entries[i].is_dir)
+        sprintf(display, "[DIR] %s", entry_name(i));
+    else
+        sprintf(display, "      %s", entry_name(i));
+
+    XDrawString(dpy, backbuf, gc, MARGIN, y + fontinfo->ascent,
+               display, strlen(display));
+}
+
+/* Copy a finished rectangle of the back buffer to the window */
+static void present(int x, int y, int w, int h)
+{
+    XCopyArea(dpy, backbuf, win, gc, x, y, w, h, x, y);
+}
+
+/* Remember a horizontal band to redraw once the event batch is done */
+static void damage(int y, int h)
+{
+    if (dirty_y0 >= dirty_y1) {
+        dirty_y0 = y;
+        dirty_y1 = y + h;
+        return;
+    }
+    if (y < dirty_y0) dirty_y0 = y;
+    if (y + h > dirty_y1) dirty_y1 = y + h;
+}
+
+static void damage_row(int i)
+{
+    damage(MARGIN + (i - top) * LINE_HEIGHT, LINE_HEIGHT);
+}
+
+/* Repaint one rectangle of the window */
+static void draw_area(int x, int y, int w, int h)
+{
+    XRectangle clip;
+    int i, first, last;
+
+    clip.x = x;
+    clip.y = y;
+    clip.width = w;
+    clip.height = h;
+    XSetClipRectangles(dpy, gc, 0, 0, &clip, 1, Unsorted);
 
     /* Clear with white */
     XSetForeground(dpy, gc, white_pixel);
-    XFillRectangle(dpy, win, gc, 0, 0, WINDOW_W, WINDOW_H);
+    XFillRectangle(dpy, backbuf, gc, x, y, w, h);
     XSetForeground(dpy, gc, black_pixel);
 
-    for (i = 0; i < nentries; i++) {
-        y = MARGIN + i * LINE_HEIGHT;
-        
-        /* Draw selection highlight */
-        if (i == selected) {
-            XSetForeground(dpy, gc, 0xCCCCCC);
-            XFillRectangle(dpy, win, gc, 0, y, WINDOW_W, LINE_HEIGHT);
-            XSetForeground(dpy, gc, black_pixel);
-        }
-        
-        if (entries[i].is_dir)
-            sprintf(display, "[DIR] %s", entries[i].name);
-        else
-            sprintf(display, "      %s", entries[i].name);
-            
-        XDrawString(dpy, win, gc, MARGIN, y + fontinfo->ascent, 
-                   display, strlen(display));
-    }
-    
+    first = top + (y - MARGIN) / LINE_HEIGHT;
+    last = top + (y + h - MARGIN + LINE_HEIGHT - 1) / LINE_HEIGHT;
+    if (first < top) first = top;
+    if (last > top + LIST_ROWS) last = top + LIST_ROWS;
+    for (i = first; i < nentries && i < last; i++)
+        draw_row(i);
+
     /* Show current directory */
-    XDrawString(dpy, win, gc, MARGIN, WINDOW_H - MARGIN, cwd, strlen(cwd));
+    XDrawString(dpy, backbuf, gc, MARGIN, WINDOW_H - MARGIN, cwd, strlen(cwd));
+
+    XSetClipMask(dpy, gc, None);
+    present(x, y, w, h);
+}
+
+static void draw_list(void)
+{
+    draw_area(0, 0, WINDOW_W, WINDOW_H);
 }
 
 static void open_entry(int idx)
@@ -124,7 +238,7 @@ static void open_entry(int idx)
     if (idx < 0 || idx >= nentries) return;
 
     if (entries[idx].is_dir) {
-        if (strcmp(entries[idx].name, "..") == 0) {
+        if (strcmp(entry_name(idx), "..") == 0) {
             p = strrchr(cwd, '/');
             if (!p || p == cwd)
                 strcpy(cwd, "/");
@@ -132,21 +246,21 @@ static void open_entry(int idx)
                 *p = '\0';
         } else {
             if (strcmp(cwd, "/") == 0)
-                sprintf(newpath, "/%s", entries[idx].name);
+                sprintf(newpath, "/%s", entry_name(idx));
             else
-                sprintf(newpath, "%s/%s", cwd, entries[idx].name);
+                sprintf(newpath, "%s/%s", cwd, entry_name(idx));
             strcpy(cwd, newpath);
         }
         read_dir(cwd);
-        draw_list();
+        damage(0, WINDOW_H);
     } else {
         int pid = fork();
         if (pid == 0) {
             char filepath[1024];
             if (strcmp(cwd, "/") == 0)
-                sprintf(filepath, "/%s", entries[idx].name);
+                sprintf(filepath, "/%s", entry_name(idx));
             else
-                sprintf(filepath, "%s/%s", cwd, entries[idx].name);
+                sprintf(filepath, "%s/%s", cwd, entry_name(idx));
                 
             execlp("xterm", "xterm", "-e", "vi", filepath, NULL);
             _exit(1);
@@ -154,12 +268,29 @@ static void open_entry(int idx)
     }
 }
 
+/* Mouse wheel: scroll the view, the selection stays inside it */
+static void scroll_by(int delta)
+{
+    top += delta;
+    if (top > nentries - LIST_ROWS)
+        top = nentries - LIST_ROWS;
+    if (top < 0)
+        top = 0;
+    if (selected < top)
+        selected = top;
+    if (selected >= top + LIST_ROWS)
+        selected = top + LIST_ROWS - 1;
+    damage(0, WINDOW_H);
+}
+
 static void handle_click(int y)
 {
-    int idx = (y - MARGIN) / LINE_HEIGHT;
-    if (idx >= 0 && idx < nentries) {
+    int row = (y - MARGIN) / LINE_HEIGHT;
+    int idx = top + row;
+    if (y >= MARGIN && row < LIST_ROWS && idx < nentries) {
+        damage_row(selected);
         selected = idx;
-        draw_list();
+        damage_row(selected);
         open_entry(idx);
     }
 }
@@ -169,6 +300,7 @@ static void handle_keypress(XKeyEvent *keyev)
     KeySym ks;
     char buf[16];
     int len;
+    int old = selected, old_top = top;
 
     len = XLookupString(keyev, buf, sizeof(buf), &ks, NULL);
     
@@ -180,13 +312,31 @@ static void handle_keypress(XKeyEvent *keyev)
             open_entry(selected);
         }
     } else {
-        /* Arrow keys */
+        /* Arrow and paging keys */
         if (ks == XK_Up) {
             if (selected > 0) selected--;
-            draw_list();
         } else if (ks == XK_Down) {
             if (selected < nentries-1) selected++;
-            draw_list();
+        } else if (ks == XK_Page_Up) {
+            selected -= LIST_ROWS - 1;
+            if (selected < 0) selected = 0;
+        } else if (ks == XK_Page_Down) {
+            selected += LIST_ROWS - 1;
+            if (selected > nentries-1) selected = nentries-1;
+        } else if (ks == XK_Home) {
+            selected = 0;
+        } else if (ks == XK_End) {
+            selected = nentries-1;
+        } else {
+            return;
+        }
+        scroll_to_selected();
+        if (top != old_top) {
+            damage(0, WINDOW_H);
+        } else if (selected != old) {
+            /* Only the two rows whose highlight changed */
+            damage_row(old);
+            damage_row(selected);
         }
     }
 }
@@ -220,18 +370,38 @@ int main(int argc, char **argv)
     gc = XCreateGC(dpy, win, 0, NULL);
     if (fontinfo)
         XSetFont(dpy, gc, fontinfo->fid);
+    XSetGraphicsExposures(dpy, gc, False);
+
+    backbuf = XCreatePixmap(dpy, win, WINDOW_W, WINDOW_H,
+                            DefaultDepth(dpy, 0));
 
     read_dir(cwd);
+    draw_list();
 
     while (1) {
+        /* Handle the whole queue first, auto-repeat bursts included */
         XNextEvent(dpy, &ev);
         if (ev.type == Expose) {
-            draw_list();
+            /* Back buffer is current, just copy the exposed part */
+            present(ev.xexpose.x, ev.xexpose.y,
+                    ev.xexpose.width, ev.xexpose.height);
+        } else if (ev.type == ButtonPress && ev.xbutton.button == Button4) {
+            scroll_by(-3);
+        } else if (ev.type == ButtonPress && ev.xbutton.button == Button5) {
+            scroll_by(3);
         } else if (ev.type == ButtonPress) {
             handle_click(ev.xbutton.y);
         } else if (ev.type == KeyPress) {
             handle_keypress(&ev.xkey);
         }
+        if (XPending(dpy))
+            continue;
+
+        /* ...then redraw once for all of it */
+        if (dirty_y0 < dirty_y1) {
+            draw_area(0, dirty_y0, WINDOW_W, dirty_y1 - dirty_y0);
+            dirty_y0 = dirty_y1 = 0;
+        }
     }
 
     return 0;
@@ -12,8 +12,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 
@@ -21,27 +33,100 @@
 #define WINDOW_H 400
 #define LINE_HEIGHT 16
 #define MARGIN 5
+#define LIST_ROWS ((WINDOW_H - 2*MARGIN) / LINE_HEIGHT)
 #define DOUBLE_CLICK_DELAY 300  // milliseconds
+#define META_SLOTS 64       /* stat requests in flight at once */
+#define META_THREADS 4      /* fallback pool when there is no io_uring */
+
+/* Entry.has_meta */
+#define META_NONE 0
+#define META_DONE 1
+#define META_QUEUED 2
 
 typedef struct Entry {
-    char name[256];
+    unsigned int name_off;  /* offset of the name in names[] */
     int is_dir;
     char perms[11];
     mode_t mode;
+    int has_meta;   /* META_DONE once perms/mode are filled in */
 } Entry;
 
+/*
+ * One stat in flight: the name is copied in, since names[] can move
+ * before the answer comes back, and gen tells answers for a directory
+ * we have already left
+ */
+typedef struct MetaSlot {
+    int idx;            /* entry; -1 while the slot is free */
+    unsigned gen;
+    int dfd;
+    int res;            /* 0 or -errno */
+    mode_t mode;
+#ifdef HAVE_IO_URING
+    struct statx stx;
+#endif
+    char name[NAME_MAX + 1];
+} MetaSlot;
+
+/* A directory we left while stats on its fd were still in flight */
+typedef struct MetaDir {
+    unsigned gen;
+    int fd;
+    int busy;           /* its slots not yet answered */
+} MetaDir;
+
 static Display *dpy;
 static Window win;
 static GC gc;
 static XFontStruct *fontinfo;
+static Pixmap backbuf;  // список рисуется сюда, потом копируется в окно
 
-static Entry entries[1000];
+static Entry *entries = NULL;
 static int nentries = 0;
+static int entries_cap = 0;
+static char *names = NULL;      /* all names, back to back */
+static size_t names_len = 0;
+static size_t names_cap = 0;
 static char cwd[1024];
+static int dir_fd = -1;
 static int selected_idx = -1;
+static int top = 0;     /* first visible entry */
+static int need_redraw = 0;
 static struct timespec last_click_time = {0};
 static int last_click_idx = -1;
 
+/* Metadata requests, see meta_pump() */
+static MetaSlot meta_slots[META_SLOTS];
+static int meta_free[META_SLOTS];        /* free slot numbers, a stack */
+static int nmeta_free = 0;
+static unsigned meta_gen = 0;           /* bumped by read_dir() */
+static int meta_next = 0;               /* next entry for the background */
+static int meta_busy = 0;               /* slots in flight on dir_fd */
+static MetaDir meta_dirs[META_SLOTS];   /* each has a slot in flight */
+static int nmeta_dirs = 0;
+static int meta_fd = -1;                /* polled for answers; -1: inline */
+#ifdef HAVE_IO_URING
+static int ring_fd = -1;
+static unsigned *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned ring_unsent = 0;        /* sqes not yet io_uring_enter()ed */
+#endif
+/*
+ * The fallback pool: queued and answered slot numbers, and a pipe.
+ * meta_todo is a FIFO ring, so the rows on screen that meta_pump()
+ * queues first are also stat()ed first.
+ */
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t meta_cond = PTHREAD_COND_INITIALIZER;
+static int meta_todo[META_SLOTS];               /* under meta_lock */
+static unsigned todo_head = 0, todo_tail = 0;   /* under meta_lock */
+static int meta_done[META_SLOTS], ndone = 0;    /* under meta_lock */
+static int meta_pipe[2] = { -1, -1 };
+
+static void meta_pump(void);
+
 static void mode_to_str(mode_t mode, char *out)
 {
     out[0] = S_ISDIR(mode) ? 'd' : '-';
@@ -57,65 +142,432 @@ static void mode_to_str(mode_t mode, char *out)
     out[10] = '\0';
 }
 
+/* Name of entry i, NUL-terminated inside names[] */
+static const char *entry_name(int i)
+{
+    return names + entries[i].name_off;
+}
+
+/*
+ * Make room for entry nentries and copy its name into the arena.
+ * Both arrays grow by doubling, so memory follows the real number of
+ * entries and the real length of their names.
+ */
+static int store_name(const char *name)
+{
+    size_t len = strlen(name) + 1;
+    size_t ncap;
+    int ecap;
+    Entry *etmp;
+    char *ntmp;
+
+    if (nentries == entries_cap) {
+        ecap = entries_cap ? entries_cap * 2 : 256;
+        etmp = (Entry*)realloc(entries, sizeof(Entry) * ecap);
+        if (!etmp) return -1;
+        entries = etmp;
+        entries_cap = ecap;
+    }
+    if (names_len + len > names_cap) {
+        ncap = names_cap ? names_cap : 4096;
+        while (names_len + len > ncap) ncap *= 2;
+        ntmp = (char*)realloc(names, ncap);
+        if (!ntmp) return -1;
+        names = ntmp;
+        names_cap = ncap;
+    }
+    entries[nentries].name_off = names_len;
+    memcpy(names + names_len, name, len);
+    names_len += len;
+    return 0;
+}
+
 static void read_dir(const char *path)
 {
     DIR *d;
     struct dirent *de;
     struct stat st;
-    char full[1024];
+    int is_dir;
 
     d = opendir(path);
     if (!d) {
         perror("opendir");
         return;
     }
+    /*
+     * Stats still in flight name the old fd; closing it now would let
+     * them run against whatever reuses the number. meta_answer()
+     * closes it after the last of them.
+     */
+    if (dir_fd >= 0 && meta_busy > 0) {
+        meta_dirs[nmeta_dirs].gen = meta_gen;
+        meta_dirs[nmeta_dirs].fd = dir_fd;
+        meta_dirs[nmeta_dirs].busy = meta_busy;
+        nmeta_dirs++;
+    } else if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+    meta_busy = 0;
+    dir_fd = dup(dirfd(d));
+    if (dir_fd >= 0) fcntl(dir_fd, F_SETFD, FD_CLOEXEC);
 
     nentries = 0;
+    names_len = 0;
     selected_idx = -1;
+    top = 0;
+    /* answers still on their way belong to the old directory */
+    meta_gen++;
+    meta_next = 0;
 
     if (strcmp(path, "/") != 0) {
-        strcpy(entries[nentries].name, "..");
+        if (store_name("..") < 0) {
+            closedir(d);
+            return;
+        }
         entries[nentries].is_dir = 1;
         strcpy(entries[nentries].perms, "drwx------");
         entries[nentries].mode = S_IFDIR | 0700;
+        entries[nentries].has_meta = 1;
         nentries++;
     }
 
-    while ((de = readdir(d)) != NULL && nentries < 1000) {
+    while ((de = readdir(d)) != NULL) {
         if (strcmp(de->d_name, ".") == 0) continue;
-        snprintf(full, sizeof(full), "%s/%s", path, de->d_name);
-        if (stat(full, &st) == 0) {
-            strncpy(entries[nentries].name, de->d_name, 255);
-            entries[nentries].is_dir = S_ISDIR(st.st_mode);
-            entries[nentries].mode = st.st_mode;
-            mode_to_str(st.st_mode, entries[nentries].perms);
-            nentries++;
-        }
+        // stat только для symlink и DT_UNKNOWN, права читаются позже
+#ifdef DT_UNKNOWN
+        if (de->d_type == DT_DIR)
+            is_dir = 1;
+        else if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
+            is_dir = 0;
+        else
+#endif
+            is_dir = fstatat(dirfd(d), de->d_name, &st, 0) == 0 &&
+                     S_ISDIR(st.st_mode);
+
+        if (store_name(de->d_name) < 0)
+            break; /* OOM */
+        entries[nentries].is_dir = is_dir;
+        /* blank until its stat answers, not some older entry's */
+        strcpy(entries[nentries].perms, "          ");
+        entries[nentries].has_meta = META_NONE;
+        nentries++;
     }
     closedir(d);
+    meta_pump();
+}
+
+/* Fill perms for entry i from a stat answer: 0 and its mode, or -errno */
+static void entry_meta(int i, int res, mode_t mode)
+{
+    Entry *e = &entries[i];
+
+    e->has_meta = META_DONE;
+    if (res == 0) {
+        e->mode = mode;
+        mode_to_str(mode, e->perms);
+    } else {
+        e->mode = e->is_dir ? S_IFDIR : 0;
+        strcpy(e->perms, "??????????");
+    }
+}
+
+/*
+ * Metadata. Rows are listed with their names alone and their
+ * permissions arrive later: META_SLOTS fstatat()s at a time go out as
+ * IORING_OP_STATX requests on an io_uring, or to a small thread pool
+ * where there is none, rows on screen first and then the rest of the
+ * directory. The main loop polls meta_fd next to the X connection and
+ * each answer fills in its row, so a cold cache or a network mount no
+ * longer holds up listing or scrolling.
+ */
+#ifdef HAVE_IO_URING
+/* Set up a ring of META_SLOTS entries, if the kernel can statx on one */
+static int ring_start(void)
+{
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+    int ok;
+
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, META_SLOTS, &p);
+    if (ring_fd < 0) return -1;
+    probe = (struct io_uring_probe*)calloc(1, sizeof(*probe) +
+                                           256 * sizeof(probe->ops[0]));
+    ok = probe != NULL &&
+         syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+                 probe, 256) == 0 &&
+         probe->last_op >= IORING_OP_STATX &&
+         (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len) {
+        sq_len = cq_len;
+    }
+    sq = cq = (char*)MAP_FAILED;
+    sqes = (struct io_uring_sqe*)MAP_FAILED;
+    if (ok) {
+        sq = (char*)mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd,
+                         IORING_OFF_SQ_RING);
+        cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+             (char*)mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd,
+                         IORING_OFF_CQ_RING);
+        sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries *
+                                          sizeof(struct io_uring_sqe),
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, ring_fd,
+                                          IORING_OFF_SQES);
+    }
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        /* the mappings go with the fd */
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    fcntl(ring_fd, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+#endif
+
+/* Fallback: stat whatever is queued, answer through the pipe */
+static void *meta_main(void *arg)
+{
+    struct stat st;
+    MetaSlot *m;
+    int s;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&meta_lock);
+        while (todo_head == todo_tail) {
+            pthread_cond_wait(&meta_cond, &meta_lock);
+        }
+        s = meta_todo[todo_head++ % META_SLOTS];
+        pthread_mutex_unlock(&meta_lock);
+
+        m = &meta_slots[s];
+        if (fstatat(m->dfd, m->name, &st, 0) == 0) {
+            m->res = 0;
+            m->mode = st.st_mode;
+        } else {
+            m->res = -errno;
+        }
+        pthread_mutex_lock(&meta_lock);
+        meta_done[ndone++] = s;
+        pthread_mutex_unlock(&meta_lock);
+        if (write(meta_pipe[1], "m", 1) < 0 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+    return NULL;
+}
+
+/* Pick a backend: io_uring, else the pool, else stat inline */
+static void meta_start(void)
+{
+    pthread_t t;
+    int i, n = 0;
+
+    for (i = 0; i < META_SLOTS; i++) {
+        meta_slots[i].idx = -1;
+        meta_free[nmeta_free++] = i;
+    }
+#ifdef HAVE_IO_URING
+    if (ring_start() == 0) {
+        meta_fd = ring_fd;
+        return;
+    }
+#endif
+    if (pipe(meta_pipe) != 0) return;
+    fcntl(meta_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(meta_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(meta_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(meta_pipe[1], F_SETFD, FD_CLOEXEC);
+    for (i = 0; i < META_THREADS; i++) {
+        if (pthread_create(&t, NULL, meta_main, NULL) == 0) {
+            pthread_detach(t);
+            n++;
+        }
+    }
+    if (n > 0) meta_fd = meta_pipe[0];
+}
+
+/* Ask for entry i's metadata, if it has none and a slot is free */
+static void meta_queue(int i)
+{
+    struct stat st;
+    MetaSlot *m;
+    int s;
+
+    if (entries[i].has_meta != META_NONE || nmeta_free == 0) return;
+    if (meta_fd < 0) {
+        /* no backend: the old way, at once */
+        if (dir_fd >= 0 && fstatat(dir_fd, entry_name(i), &st, 0) == 0) {
+            entry_meta(i, 0, st.st_mode);
+        } else {
+            entry_meta(i, -ENOENT, 0);
+        }
+        return;
+    }
+    s = meta_free[--nmeta_free];
+    m = &meta_slots[s];
+    m->idx = i;
+    m->gen = meta_gen;
+    m->dfd = dir_fd;
+    meta_busy++;
+    strncpy(m->name, entry_name(i), sizeof(m->name) - 1);
+    m->name[sizeof(m->name) - 1] = '\0';
+    entries[i].has_meta = META_QUEUED;
+#ifdef HAVE_IO_URING
+    if (ring_fd >= 0) {
+        unsigned tail = *sq_tail;
+        unsigned k = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[k];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = m->dfd;
+        sqe->addr = (unsigned long)m->name;
+        sqe->len = STATX_MODE;
+        sqe->off = (unsigned long)&m->stx;
+        sqe->user_data = s;
+        sq_array[k] = k;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ring_unsent++;
+        return;
+    }
+#endif
+    pthread_mutex_lock(&meta_lock);
+    meta_todo[todo_tail++ % META_SLOTS] = s;
+    pthread_cond_signal(&meta_cond);
+    pthread_mutex_unlock(&meta_lock);
+}
+
+/*
+ * Keep the slots busy: rows on screen first, then the rest of the
+ * directory in order, then one io_uring_enter() for the whole batch
+ */
+static void meta_pump(void)
+{
+    int i;
+
+    for (i = top; i < nentries && i < top + LIST_ROWS && nmeta_free > 0;
+         i++) {
+        meta_queue(i);
+    }
+    while (meta_next < nentries && nmeta_free > 0) {
+        meta_queue(meta_next++);
+    }
+#ifdef HAVE_IO_URING
+    if (ring_unsent > 0 &&
+        syscall(__NR_io_uring_enter, ring_fd, ring_unsent, 0, 0, NULL,
+                0) >= 0) {
+        ring_unsent = 0;
+    }
+#endif
+}
+
+/* A slot's answer came back: fill in its row if it is still ours */
+static void meta_answer(int s)
+{
+    MetaSlot *m = &meta_slots[s];
+    int k;
+
+    if (m->gen == meta_gen) {
+        meta_busy--;
+        if (m->idx < nentries) {
+            entry_meta(m->idx, m->res, m->mode);
+            if (m->idx >= top && m->idx < top + LIST_ROWS) need_redraw = 1;
+        }
+    } else {
+        /* the last answer on a directory we left closes its fd */
+        for (k = 0; k < nmeta_dirs && meta_dirs[k].gen != m->gen; k++) {
+        }
+        if (k < nmeta_dirs && --meta_dirs[k].busy == 0) {
+            close(meta_dirs[k].fd);
+            meta_dirs[k] = meta_dirs[--nmeta_dirs];
+        }
+    }
+    m->idx = -1;
+    meta_free[nmeta_free++] = s;
+}
+
+/* meta_fd is readable: take every answer, then queue more */
+static void meta_reap(void)
+{
+    char buf[64];
+    int done[META_SLOTS];
+    int i, n;
+
+#ifdef HAVE_IO_URING
+    if (ring_fd >= 0) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        struct io_uring_cqe *cqe;
+        MetaSlot *m;
+
+        while (head != tail) {
+            cqe = &cqes[head & *cq_mask];
+            m = &meta_slots[cqe->user_data];
+            m->res = cqe->res < 0 ? cqe->res : 0;
+            m->mode = m->stx.stx_mode;
+            meta_answer((int)cqe->user_data);
+            head++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        meta_pump();
+        return;
+    }
+#endif
+    while (read(meta_pipe[0], buf, sizeof(buf)) > 0) {
+        /* drain */
+    }
+    pthread_mutex_lock(&meta_lock);
+    n = ndone;
+    memcpy(done, meta_done, sizeof(int) * n);
+    ndone = 0;
+    pthread_mutex_unlock(&meta_lock);
+    for (i = 0; i < n; i++) meta_answer(done[i]);
+    meta_pump();
 }
 
 static void draw_list(void)
 {
-    XClearWindow(dpy, win);
-    for (int i = 0; i < nentries; i++) {
-        int y = MARGIN + i * LINE_HEIGHT + fontinfo->ascent;
+    XSetForeground(dpy, gc, WhitePixel(dpy, 0));
+    XFillRectangle(dpy, backbuf, gc, 0, 0, WINDOW_W, WINDOW_H);
+    XSetForeground(dpy, gc, BlackPixel(dpy, 0));
+    for (int i = top; i < nentries && i < top + LIST_ROWS; i++) {
+        int y = MARGIN + (i - top) * LINE_HEIGHT + fontinfo->ascent;
         char display[400];
         sprintf(display, "%-11s %s%s",
                 entries[i].perms,
                 entries[i].is_dir ? "[DIR] " : "",
-                entries[i].name);
+                entry_name(i));
 
         if (i == selected_idx) {
             XSetForeground(dpy, gc, 0xC0C0C0); // серый фон
-            XFillRectangle(dpy, win, gc,
-                           0, MARGIN + i * LINE_HEIGHT,
+            XFillRectangle(dpy, backbuf, gc,
+                           0, MARGIN + (i - top) * LINE_HEIGHT,
                            WINDOW_W, LINE_HEIGHT);
             XSetForeground(dpy, gc, BlackPixel(dpy, 0));
         }
 
-        XDrawString(dpy, win, gc, MARGIN, y, display, strlen(display));
+        XDrawString(dpy, backbuf, gc, MARGIN, y, display, strlen(display));
     }
+
+    XCopyArea(dpy, backbuf, win, gc, 0, 0, WINDOW_W, WINDOW_H, 0, 0);
 }
 
 static int has_read_access(const char *path)
@@ -129,7 +581,7 @@ static void open_entry(int idx)
     if (idx < 0 || idx >= nentries) return;
 
     if (entries[idx].is_dir) {
-        if (strcmp(entries[idx].name, "..") == 0) {
+        if (strcmp(entry_name(idx), "..") == 0) {
             char *p = strrchr(cwd, '/');
             if (!p || p == cwd)
                 strcpy(cwd, "/");
@@ -138,16 +590,16 @@ static void open_entry(int idx)
         } else {
             snprintf(newpath, sizeof(newpath), "%s/%s",
                      strcmp(cwd, "/") == 0 ? "" : cwd,
-                     entries[idx].name);
+                     entry_name(idx));
             strcpy(cwd, newpath);
         }
         read_dir(cwd);
-        draw_list();
+        need_redraw = 1;
     } else {
         char filepath[1024];
         snprintf(filepath, sizeof(filepath), "%s/%s",
                  strcmp(cwd, "/") == 0 ? "" : cwd,
-                 entries[idx].name);
+                 entry_name(idx));
 
         if (!has_read_access(filepath)) {
             fprintf(stderr, "Permission denied: %s\n", filepath);
@@ -167,11 +619,22 @@ static long diff_ms(struct timespec a, struct timespec b)
     return (a.tv_sec - b.tv_sec) * 1000 + (a.tv_nsec - b.tv_nsec) / 1000000;
 }
 
+// колесо мыши — прокрутка списка
+static void scroll_by(int delta)
+{
+    top += delta;
+    if (top > nentries - LIST_ROWS) top = nentries - LIST_ROWS;
+    if (top < 0) top = 0;
+    need_redraw = 1;
+    meta_pump();
+}
+
 /* Single or double click logic */
 static void handle_click(int y)
 {
-    int idx = (y - MARGIN) / LINE_HEIGHT;
-    if (idx < 0 || idx >= nentries) return;
+    int row = (y - MARGIN) / LINE_HEIGHT;
+    int idx = top + row;
+    if (y < MARGIN || row >= LIST_ROWS || idx >= nentries) return;
 
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
@@ -179,7 +642,7 @@ static void handle_click(int y)
 
     // один клик — выделение
     selected_idx = idx;
-    draw_list();
+    need_redraw = 1;
 
     // двойной клик по той же строке за <300 мс
     if (idx == last_click_idx && diff < DOUBLE_CLICK_DELAY) {
@@ -213,16 +676,59 @@ int main(int argc, char **argv)
     if (!fontinfo) fontinfo = XLoadQueryFont(dpy, "6x13");
     gc = XCreateGC(dpy, win, 0, NULL);
     if (fontinfo) XSetFont(dpy, gc, fontinfo->fid);
+    XSetGraphicsExposures(dpy, gc, False);
 
+    backbuf = XCreatePixmap(dpy, win, WINDOW_W, WINDOW_H,
+                            DefaultDepth(dpy, 0));
+
+    meta_start();
     read_dir(cwd);
+    draw_list();
 
     XEvent ev;
+    struct pollfd pfd[2];
+    pfd[0].fd = ConnectionNumber(dpy);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = meta_fd;
+    pfd[1].events = POLLIN;
     while (1) {
+        // ждём X или ответы stat
+        if (!XPending(dpy)) {
+            XFlush(dpy);
+            if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            if (pfd[1].revents & POLLIN)
+                meta_reap();
+            if (!XPending(dpy)) {
+                if (need_redraw) {
+                    draw_list();
+                    need_redraw = 0;
+                }
+                continue;
+            }
+        }
         XNextEvent(dpy, &ev);
         if (ev.type == Expose)
-            draw_list();
+            XCopyArea(dpy, backbuf, win, gc,
+                      ev.xexpose.x, ev.xexpose.y,
+                      ev.xexpose.width, ev.xexpose.height,
+                      ev.xexpose.x, ev.xexpose.y);
+        else if (ev.type == ButtonPress && ev.xbutton.button == Button4)
+            scroll_by(-3);
+        else if (ev.type == ButtonPress && ev.xbutton.button == Button5)
+            scroll_by(3);
         else if (ev.type == ButtonPress)
             handle_click(ev.xbutton.y);
+
+        // сначала вся очередь событий, потом одна перерисовка
+        if (XPending(dpy))
+            continue;
+        if (need_redraw) {
+            draw_list();
+            need_redraw = 0;
+        }
     }
 
     return 0;